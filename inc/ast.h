@@ -1,62 +1,120 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <iostream>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/ADT/StringRef.h>
 #include <llvm/IR/Value.h>
+#include <llvm/Support/Allocator.h>
+#include <llvm/Support/Casting.h>
+#include <llvm/Support/raw_ostream.h>
 #include <memory>
 #include <string>
 #include <vector>
 
-struct AST {
-  virtual void dump() = 0;
-  virtual ~AST() = default;
+#include "symbol.h"
+
+// Front-end counters, printed by --ast-stats. Parsers on any thread add to
+// them once per top-level item.
+struct ASTStats {
+  std::atomic<uint64_t> Nodes{0};
+  std::atomic<uint64_t> ArenaBytes{0};
+  std::atomic<uint64_t> ParseNanos{0};
+  void addParse(std::chrono::steady_clock::time_point Start,
+                uint64_t ItemNodes = 0, uint64_t ItemBytes = 0) {
+    auto Time = std::chrono::steady_clock::now() - Start;
+    ParseNanos += std::chrono::nanoseconds(Time).count();
+    Nodes += ItemNodes;
+    ArenaBytes += ItemBytes;
+  }
+  void print(llvm::raw_ostream &OS) const;
+};
+extern ASTStats TheASTStats;
+
+// Expression nodes are bump-allocated in the ASTArena of their definition and
+// never destroyed one by one: every member is trivially destructible, and the
+// whole arena is released at once when the definition goes away. Nodes carry
+// their Kind instead of a vtable and are dispatched with a switch.
+struct ExprAST {
+  enum Kind : uint8_t { Num, Var, Bin, Call, If, For, PFor, Index };
+
+  const Kind kind;
+
+  llvm::Value *codegen();
+  void dump() const;
+
+protected:
+  ExprAST(Kind kind) : kind(kind) {}
 };
 
-struct ExprAST : AST {
-  virtual llvm::Value *codegen() = 0;
+class ASTArena {
+  llvm::BumpPtrAllocator Alloc;
+
+public:
+  uint64_t Nodes = 0;
+  uint64_t Bytes = 0;
+
+  template <typename T, typename... Args> T *create(Args &&...args) {
+    ++Nodes;
+    Bytes += sizeof(T);
+    return new (Alloc.Allocate<T>()) T(std::forward<Args>(args)...);
+  }
+
+  llvm::ArrayRef<ExprAST *> save(llvm::ArrayRef<ExprAST *> A) {
+    Bytes += A.size() * sizeof(ExprAST *);
+    auto P = Alloc.Allocate<ExprAST *>(A.size());
+    std::copy(A.begin(), A.end(), P);
+    return llvm::ArrayRef<ExprAST *>(P, A.size());
+  }
 };
-using ExprPtr = std::unique_ptr<ExprAST>;
-using ExprVec = std::vector<ExprPtr>;
 
 struct NumExprAST : ExprAST {
   double val;
-  NumExprAST(double val) : val(val) {}
-  virtual void dump() override { std::cerr << val; }
-  virtual llvm::Value *codegen() override;
+  NumExprAST(double val) : ExprAST(Num), val(val) {}
+  static bool classof(const ExprAST *E) { return E->kind == Num; }
+  void dump() const { std::cerr << val; }
+  llvm::Value *codegen();
 };
 
 struct VarExprAST : ExprAST {
-  std::string name;
-  VarExprAST(std::string name) : name(std::move(name)) {}
-  virtual void dump() override { std::cerr << name; }
-  virtual llvm::Value *codegen() override;
+  Symbol name;
+  VarExprAST(Symbol name) : ExprAST(Var), name(name) {}
+  static bool classof(const ExprAST *E) { return E->kind == Var; }
+  void dump() const { std::cerr << name; }
+  llvm::Value *codegen();
 };
 
 struct BinExprAST : ExprAST {
   char op;
-  ExprPtr lhs;
-  ExprPtr rhs;
-  BinExprAST(char op, ExprPtr lhs, ExprPtr rhs)
-      : op(op), lhs(std::move(lhs)), rhs(std::move(rhs)) {}
-  virtual void dump() override {
+  ExprAST *lhs;
+  ExprAST *rhs;
+  BinExprAST(char op, ExprAST *lhs, ExprAST *rhs)
+      : ExprAST(Bin), op(op), lhs(lhs), rhs(rhs) {}
+  static bool classof(const ExprAST *E) { return E->kind == Bin; }
+  void dump() const {
     std::cerr << '(';
     lhs->dump();
     std::cerr << op;
     rhs->dump();
     std::cerr << ')';
   }
-  virtual llvm::Value *codegen() override;
+  llvm::Value *codegen();
 };
 
 struct CallExprAST : ExprAST {
-  std::string callee;
-  ExprVec arguments;
-  CallExprAST(std::string callee, ExprVec arguments)
-      : callee(std::move(callee)), arguments(std::move(arguments)) {}
-  virtual void dump() override {
+  Symbol callee;
+  llvm::ArrayRef<ExprAST *> arguments;
+  CallExprAST(Symbol callee, llvm::ArrayRef<ExprAST *> arguments)
+      : ExprAST(Call), callee(callee), arguments(arguments) {}
+  static bool classof(const ExprAST *E) { return E->kind == Call; }
+  void dump() const {
     std::cerr << callee;
     std::cerr << '(';
     int flag = 0;
-    for (auto &arg : arguments) {
+    for (auto arg : arguments) {
       if (flag)
         std::cerr << ',';
       arg->dump();
@@ -64,14 +122,15 @@ struct CallExprAST : ExprAST {
     }
     std::cerr << ')';
   }
-  virtual llvm::Value *codegen() override;
+  llvm::Value *codegen();
 };
 
 struct IfExprAST : ExprAST {
-  ExprPtr Cond, Then, Else;
-  IfExprAST(ExprPtr Cond, ExprPtr Then, ExprPtr Else)
-      : Cond(std::move(Cond)), Then(std::move(Then)), Else(std::move(Else)) {}
-  virtual void dump() override {
+  ExprAST *Cond, *Then, *Else;
+  IfExprAST(ExprAST *Cond, ExprAST *Then, ExprAST *Else)
+      : ExprAST(If), Cond(Cond), Then(Then), Else(Else) {}
+  static bool classof(const ExprAST *E) { return E->kind == If; }
+  void dump() const {
     std::cerr << "if ";
     Cond->dump();
     std::cerr << " then ";
@@ -79,17 +138,18 @@ struct IfExprAST : ExprAST {
     std::cerr << " else ";
     Else->dump();
   }
-  virtual llvm::Value *codegen() override;
+  llvm::Value *codegen();
 };
 
 struct ForExprAST : ExprAST {
-  std::string name;
-  ExprPtr Init, Cond, Next, Body;
-  ForExprAST(std::string name, ExprPtr Init, ExprPtr Cond, ExprPtr Next,
-             ExprPtr Body)
-      : name(std::move(name)), Init(std::move(Init)), Cond(std::move(Cond)),
-        Next(std::move(Next)), Body(std::move(Body)) {}
-  virtual void dump() override {
+  Symbol name;
+  ExprAST *Init, *Cond, *Next, *Body;
+  ForExprAST(Symbol name, ExprAST *Init, ExprAST *Cond, ExprAST *Next,
+             ExprAST *Body)
+      : ExprAST(For), name(name), Init(Init), Cond(Cond), Next(Next),
+        Body(Body) {}
+  static bool classof(const ExprAST *E) { return E->kind == For; }
+  void dump() const {
     std::cerr << "for " << name << " = ";
     Init->dump();
     std::cerr << ", ";
@@ -99,39 +159,201 @@ struct ForExprAST : ExprAST {
     std::cerr << " in ";
     Body->dump();
   }
-  virtual llvm::Value *codegen() override;
+  llvm::Value *codegen();
+};
+
+// `pfor name = Begin, End [, Chunk] [reduce op] in Body` runs Body for every
+// integer name in [Begin, End) on the pfor worker pool, in chunks of Chunk
+// iterations. Iterations must be independent. The value is 0, or with
+// `reduce +` or `reduce *` the sum or product of the values of Body.
+struct PForExprAST : ExprAST {
+  Symbol name;
+  ExprAST *Begin, *End, *Chunk;
+  char Reduce;
+  ExprAST *Body;
+  PForExprAST(Symbol name, ExprAST *Begin, ExprAST *End, ExprAST *Chunk,
+              char Reduce, ExprAST *Body)
+      : ExprAST(PFor), name(name), Begin(Begin), End(End), Chunk(Chunk),
+        Reduce(Reduce), Body(Body) {}
+  static bool classof(const ExprAST *E) { return E->kind == PFor; }
+  void dump() const {
+    std::cerr << "pfor " << name << " = ";
+    Begin->dump();
+    std::cerr << ", ";
+    End->dump();
+    if (Chunk) {
+      std::cerr << ", ";
+      Chunk->dump();
+    }
+    if (Reduce)
+      std::cerr << " reduce " << Reduce;
+    std::cerr << " in ";
+    Body->dump();
+  }
+  llvm::Value *codegen();
+};
+
+// `buffer[index]` reads an element of a buf parameter, and
+// `buffer[index] = value` writes one and evaluates to the value written. The
+// index is checked against the length of the buffer.
+struct IndexExprAST : ExprAST {
+  Symbol buffer;
+  ExprAST *index;
+  ExprAST *value;
+  IndexExprAST(Symbol buffer, ExprAST *index, ExprAST *value)
+      : ExprAST(Index), buffer(buffer), index(index), value(value) {}
+  static bool classof(const ExprAST *E) { return E->kind == Index; }
+  void dump() const {
+    std::cerr << buffer << '[';
+    index->dump();
+    std::cerr << ']';
+    if (value) {
+      std::cerr << " = ";
+      value->dump();
+    }
+  }
+  llvm::Value *codegen();
 };
 
-struct ProtoTypeAST : AST {
-  std::string name;
-  std::vector<std::string> parameters;
-  ProtoTypeAST(std::string name, std::vector<std::string> parameters)
-      : name(std::move(name)), parameters(std::move(parameters)) {}
-  virtual void dump() override {
+inline void ExprAST::dump() const {
+  switch (kind) {
+  case Num:
+    return llvm::cast<NumExprAST>(this)->dump();
+  case Var:
+    return llvm::cast<VarExprAST>(this)->dump();
+  case Bin:
+    return llvm::cast<BinExprAST>(this)->dump();
+  case Call:
+    return llvm::cast<CallExprAST>(this)->dump();
+  case If:
+    return llvm::cast<IfExprAST>(this)->dump();
+  case For:
+    return llvm::cast<ForExprAST>(this)->dump();
+  case PFor:
+    return llvm::cast<PForExprAST>(this)->dump();
+  case Index:
+    return llvm::cast<IndexExprAST>(this)->dump();
+  }
+}
+
+// Calls F on every direct subexpression of E, in evaluation order.
+template <typename Fn> void forEachChild(const ExprAST *E, Fn F) {
+  switch (E->kind) {
+  case ExprAST::Num:
+  case ExprAST::Var:
+    return;
+  case ExprAST::Bin:
+    F(llvm::cast<BinExprAST>(E)->lhs);
+    F(llvm::cast<BinExprAST>(E)->rhs);
+    return;
+  case ExprAST::Call:
+    for (auto arg : llvm::cast<CallExprAST>(E)->arguments)
+      F(arg);
+    return;
+  case ExprAST::If: {
+    auto I = llvm::cast<IfExprAST>(E);
+    F(I->Cond);
+    F(I->Then);
+    F(I->Else);
+    return;
+  }
+  case ExprAST::For: {
+    auto L = llvm::cast<ForExprAST>(E);
+    F(L->Init);
+    F(L->Cond);
+    F(L->Body);
+    F(L->Next);
+    return;
+  }
+  case ExprAST::PFor: {
+    auto P = llvm::cast<PForExprAST>(E);
+    F(P->Begin);
+    F(P->End);
+    if (P->Chunk)
+      F(P->Chunk);
+    F(P->Body);
+    return;
+  }
+  case ExprAST::Index: {
+    auto I = llvm::cast<IndexExprAST>(E);
+    F(I->index);
+    if (I->value)
+      F(I->value);
+    return;
+  }
+  }
+}
+
+// The types of values. Parameters and results are f64 unless annotated, as
+// in `def f(n: i64, x: f32): f32`; expressions take their type from their
+// operands. A buf parameter is a pointer to a host-owned KaleBuffer.
+enum class NumType : uint8_t { F64, F32, I64, Buf };
+
+inline const char *getTypeName(NumType T) {
+  switch (T) {
+  case NumType::F64:
+    return "f64";
+  case NumType::F32:
+    return "f32";
+  case NumType::I64:
+    return "i64";
+  case NumType::Buf:
+    return "buf";
+  }
+  return nullptr;
+}
+
+// Prototypes outlive their definition in FunctionProtos, so they are not
+// allocated in its arena.
+struct ProtoTypeAST {
+  Symbol name;
+  std::vector<Symbol> parameters;
+  std::vector<NumType> types;
+  NumType result = NumType::F64;
+  // Compile the definition with fast-math flags: `def fast f(x)`.
+  bool fast = false;
+  ProtoTypeAST(Symbol name, std::vector<Symbol> parameters)
+      : name(name), parameters(std::move(parameters)),
+        types(this->parameters.size(), NumType::F64) {}
+  // Whether the function can be called as double(double, ...).
+  bool isAllF64() const {
+    return result == NumType::F64 &&
+           llvm::all_of(types, [](NumType T) { return T == NumType::F64; });
+  }
+  // Whether calls compiled against Other can call this function.
+  bool hasSameSignature(const ProtoTypeAST &Other) const {
+    return types == Other.types && result == Other.result;
+  }
+  void dump() const {
+    if (fast)
+      std::cerr << "fast ";
     std::cerr << name;
     std::cerr << '(';
-    int flag = 0;
-    for (auto &par : parameters) {
-      if (flag)
+    for (size_t i = 0; i < parameters.size(); ++i) {
+      if (i)
         std::cerr << ',';
-      std::cerr << par;
-      flag = 1;
+      std::cerr << parameters[i];
+      if (types[i] != NumType::F64)
+        std::cerr << ": " << getTypeName(types[i]);
     }
     std::cerr << ')';
+    if (result != NumType::F64)
+      std::cerr << ": " << getTypeName(result);
     std::cerr << '\n';
   }
   llvm::Function *codegen();
 };
 
-struct FuncAST : AST {
+struct FuncAST {
   ProtoTypeAST proto;
-  ExprPtr body;
-  FuncAST(ProtoTypeAST proto, ExprPtr body)
-      : proto(std::move(proto)), body(std::move(body)) {}
-  virtual void dump() override {
+  std::unique_ptr<ASTArena> arena;
+  ExprAST *body;
+  FuncAST(ProtoTypeAST proto, std::unique_ptr<ASTArena> arena, ExprAST *body)
+      : proto(std::move(proto)), arena(std::move(arena)), body(body) {}
+  void dump() const {
     std::cerr << "def ";
     proto.dump();
     body->dump();
   }
-  llvm::Function *codegen();
+  llvm::Function *codegen(bool Optimize = true);
 };
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+// The descriptor of a `buf` parameter: Size doubles at Data, owned by the
+// host. Compiled code is passed a pointer to the descriptor and reads and
+// writes the elements in place, so nothing is copied on the way in or out.
+struct KaleBuffer {
+  double *Data;
+  int64_t Size;
+};
+
+// Called by compiled code when an index is outside [0, Size). Reports the
+// access and aborts.
+extern "C" [[noreturn]] void kale_bounds_fail(int64_t Index, int64_t Size);
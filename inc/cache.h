@@ -0,0 +1,174 @@
+#pragma once
+
+#include "llvm.h"
+
+#include <algorithm>
+#include <mutex>
+
+// Persistent ObjectCache: object files are stored as <dir>/<sha1>.o, where the
+// hash covers the (already optimized) module IR and the target description.
+// The directory is kept below a size limit, unless it is 0, by evicting the
+// least recently used entries.
+class KaleidoscopeObjectCache : public llvm::ObjectCache {
+private:
+  std::string Dir;
+  std::string TargetKey;
+  uint64_t SizeLimit;
+
+  std::mutex Lock;
+  llvm::DenseMap<const llvm::Module *, std::string> PendingKeys;
+  uint64_t TotalSize = 0;
+  uint64_t Hits = 0;
+  uint64_t Misses = 0;
+  uint64_t Evictions = 0;
+
+  std::string getKey(const llvm::Module *M) {
+    std::string Buf = TargetKey;
+    Buf += '\0';
+    llvm::raw_string_ostream OS(Buf);
+    M->print(OS, nullptr);
+    OS.flush();
+    return llvm::toHex(llvm::SHA1::hash(llvm::arrayRefFromStringRef(Buf)),
+                       /*LowerCase=*/true);
+  }
+
+  std::string getPath(llvm::StringRef Key) {
+    return (Dir + "/" + Key + ".o").str();
+  }
+
+  struct Entry {
+    std::string Path;
+    llvm::sys::TimePoint<> Time;
+    uint64_t Size;
+  };
+
+  // Rescans the directory; callers must hold Lock.
+  std::vector<Entry> scan() {
+    std::vector<Entry> Entries;
+    TotalSize = 0;
+    std::error_code EC;
+    for (llvm::sys::fs::directory_iterator I(Dir, EC), E; I != E && !EC;
+         I.increment(EC)) {
+      if (llvm::sys::path::extension(I->path()) != ".o")
+        continue;
+      auto Status = I->status();
+      if (!Status)
+        continue;
+      Entries.push_back(
+          {I->path(), Status->getLastModificationTime(), Status->getSize()});
+      TotalSize += Status->getSize();
+    }
+    return Entries;
+  }
+
+  // Removes the oldest entries until the cache is a tenth below its limit,
+  // so that the inserts that follow do not each rescan the directory;
+  // callers must hold Lock.
+  void evict() {
+    auto Entries = scan();
+    std::sort(Entries.begin(), Entries.end(),
+              [](const Entry &A, const Entry &B) { return A.Time < B.Time; });
+    uint64_t LowWater = SizeLimit - SizeLimit / 10;
+    for (auto &E : Entries) {
+      if (TotalSize <= LowWater)
+        break;
+      if (!llvm::sys::fs::remove(E.Path)) {
+        TotalSize -= E.Size;
+        ++Evictions;
+      }
+    }
+  }
+
+public:
+  KaleidoscopeObjectCache(std::string Dir, std::string TargetKey,
+                          uint64_t SizeLimit)
+      : Dir(std::move(Dir)), TargetKey(std::move(TargetKey)),
+        SizeLimit(SizeLimit) {}
+
+  static llvm::Expected<std::unique_ptr<KaleidoscopeObjectCache>>
+  Create(llvm::StringRef Dir, const llvm::orc::JITTargetMachineBuilder &JTMB,
+         llvm::CodeGenOptLevel OptLevel, uint64_t SizeLimit) {
+    if (auto EC = llvm::sys::fs::create_directories(Dir))
+      return llvm::createFileError(Dir, EC);
+    std::string TargetKey;
+    llvm::raw_string_ostream OS(TargetKey);
+    OS << JTMB.getTargetTriple().str() << '|' << JTMB.getCPU() << '|'
+       << JTMB.getFeatures().getString() << '|' << int(OptLevel);
+    OS.flush();
+    auto Cache = std::make_unique<KaleidoscopeObjectCache>(
+        Dir.str(), std::move(TargetKey), SizeLimit);
+    std::lock_guard<std::mutex> Guard(Cache->Lock);
+    Cache->scan();
+    return Cache;
+  }
+
+  std::unique_ptr<llvm::MemoryBuffer>
+  getObject(const llvm::Module *M) override {
+    auto Key = getKey(M);
+    auto Path = getPath(Key);
+    // Not null terminated, so large objects are memory mapped.
+    auto Buffer =
+        llvm::MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                    /*RequiresNullTerminator=*/false);
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (!Buffer) {
+      ++Misses;
+      PendingKeys[M] = std::move(Key);
+      return nullptr;
+    }
+    ++Hits;
+    // Touch the entry so eviction sees it as recently used.
+    int FD;
+    if (!llvm::sys::fs::openFileForReadWrite(Path, FD,
+                                             llvm::sys::fs::CD_OpenExisting,
+                                             llvm::sys::fs::OF_None)) {
+      llvm::sys::fs::setLastAccessAndModificationTime(
+          FD, std::chrono::system_clock::now());
+      llvm::sys::Process::SafelyCloseFileDescriptor(FD);
+    }
+    return std::move(*Buffer);
+  }
+
+  void notifyObjectCompiled(const llvm::Module *M,
+                            llvm::MemoryBufferRef Obj) override {
+    std::string Key;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      auto I = PendingKeys.find(M);
+      if (I == PendingKeys.end())
+        return;
+      Key = std::move(I->second);
+      PendingKeys.erase(I);
+    }
+    // Write to a temporary file and rename it into place, so concurrent
+    // processes sharing the directory never see partial objects.
+    int FD;
+    llvm::SmallString<128> TmpPath;
+    if (llvm::sys::fs::createUniqueFile(Dir + "/%%%%%%%%.tmp", FD, TmpPath))
+      return;
+    {
+      llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Obj.getBuffer();
+      if (OS.has_error()) {
+        OS.clear_error();
+        llvm::sys::fs::remove(TmpPath);
+        return;
+      }
+    }
+    if (llvm::sys::fs::rename(TmpPath, getPath(Key))) {
+      llvm::sys::fs::remove(TmpPath);
+      return;
+    }
+    std::lock_guard<std::mutex> Guard(Lock);
+    TotalSize += Obj.getBufferSize();
+    if (SizeLimit && TotalSize > SizeLimit)
+      evict();
+  }
+
+  void printStats(llvm::raw_ostream &OS) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    OS << "object cache: " << Hits << " hits, " << Misses << " misses, "
+       << Evictions << " evictions, " << TotalSize << " bytes in " << Dir
+       << "\n";
+  }
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "ast.h"
+#include "llvm.h"
+
+// Checks that Def, a definition or a top-level expression, can be compiled
+// against the prototypes of TheEngine: every variable it reads is bound,
+// every function it calls has a prototype with as many parameters as the
+// call has arguments, and bufs are only indexed, passed to len or passed as
+// buf arguments. Codegen assumes all of these.
+llvm::Error checkDefinition(const FuncAST &Def);
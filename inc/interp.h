@@ -0,0 +1,48 @@
+#pragma once
+
+#include "ast.h"
+
+#include <llvm/ADT/STLFunctionalExtras.h>
+#include <vector>
+
+// A loop-free expression translated to code for a small stack machine, so
+// that a one-shot top-level expression runs without building, optimizing and
+// linking a module. Calls go straight to the compiled definitions and ext
+// symbols, so the cost of interpreting is bounded by the size of the
+// expression.
+class Bytecode {
+public:
+  // Returns the address of the function Name with Arity parameters, or null.
+  using Resolver = llvm::function_ref<void *(Symbol Name, size_t Arity)>;
+
+  static constexpr unsigned MaxArity = 6;
+
+  // Translates E. Fails, leaving the expression to the JIT, if E has a loop,
+  // reads a variable, calls a function that Resolve does not find or that
+  // takes more than MaxArity arguments, or has more than Limit nodes.
+  bool compile(const ExprAST *E, unsigned Limit, Resolver Resolve);
+
+  double run() const;
+
+private:
+  enum class Op : uint8_t { Num, Add, Sub, Mul, Less, Call, JumpIfZero, Jump };
+
+  struct Instr {
+    Instr(Op Code) : Code(Code), Value(0) {}
+    Op Code;
+    // The arity of a Call, or the target of a jump.
+    uint32_t Arg = 0;
+    union {
+      double Value;
+      void *Callee;
+    };
+  };
+
+  std::vector<Instr> Code;
+  unsigned Depth = 0;
+  unsigned MaxDepth = 0;
+
+  bool emit(const ExprAST *E, unsigned &Budget, Resolver Resolve);
+  // Appends an instruction that changes the stack depth by Effect.
+  Instr &push(Op Opcode, int Effect);
+};
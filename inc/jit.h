@@ -1,37 +1,143 @@
 #pragma once
 
 #include "ast.h"
+#include "cache.h"
 #include "llvm.h"
+#include "memo.h"
+#include "profile.h"
+#include "swap.h"
+#include "tier.h"
 
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <utility>
 
-using namespace llvm;
-using namespace orc;
+enum class CompileMode {
+  // Compile a whole module as soon as any of its symbols is looked up.
+  Eager,
+  // Put every function behind a stub and compile it on its first call.
+  Lazy,
+  // Compile every definition at -O0 behind a stub, and recompile it at -O3
+  // in the background once it has been called often enough.
+  Tiered,
+  // Compile a whole definition behind a stub, so that redefining it swaps
+  // the code under its callers and frees the old code.
+  Swap,
+};
+
+// How much of the compilation is printed to stderr.
+enum class Verbosity {
+  Silent,
+  // The AST of every item.
+  AST,
+  // Also the IR of every module handed to the JIT.
+  IR,
+  // Also every pass run by the IR pipeline.
+  Passes,
+};
+
+struct JITOptions {
+  CompileMode Mode = CompileMode::Eager;
+  // Directory of the persistent object cache; empty disables the cache.
+  std::string CacheDir;
+  // Bytes above which the cache evicts its least recently used objects (0:
+  // unlimited).
+  uint64_t CacheSizeLimit = uint64_t(512) << 20;
+  // CPU to generate code for; empty selects the host CPU and its features.
+  std::string CPU;
+  llvm::CodeGenOptLevel OptLevel = llvm::CodeGenOptLevel::Default;
+  // Describe JIT'd code to perf: with /tmp/perf-<pid>.map for `perf report`,
+  // or with a jitdump for `perf inject --jit`, which also lets `perf annotate`
+  // disassemble it.
+  bool PerfMap = false;
+  bool JITDump = false;
+  // Register JIT'd code with GDB.
+  bool GDB = false;
+  // Sample the running code ProfileRate times per second of CPU time; see
+  // SamplingProfiler.
+  bool Profile = false;
+  unsigned ProfileRate = 1000;
+};
+
+// Records the object emission of every module in the time trace, under the
+// name of its first definition.
+class TracingIRCompiler : public llvm::orc::ConcurrentIRCompiler {
+public:
+  using llvm::orc::ConcurrentIRCompiler::ConcurrentIRCompiler;
+
+  llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>
+  operator()(llvm::Module &M) override {
+    llvm::TimeTraceScope Trace("EmitObject", [&] {
+      for (auto &F : M)
+        if (!F.isDeclaration())
+          return F.getName().str();
+      return std::string();
+    });
+    return llvm::orc::ConcurrentIRCompiler::operator()(M);
+  }
+};
 
 class KaleidoscopeJIT {
 private:
-  std::unique_ptr<ExecutionSession> ES;
+  std::unique_ptr<llvm::orc::ExecutionSession> ES;
+  std::unique_ptr<llvm::orc::EPCIndirectionUtils> EPCIU;
+
+  llvm::DataLayout DL;
+  llvm::orc::MangleAndInterner Mangle;
+
+  std::unique_ptr<KaleidoscopeObjectCache> ObjCache;
 
-  DataLayout DL;
-  MangleAndInterner Mangle;
+  llvm::orc::RTDyldObjectLinkingLayer ObjectLayer;
+  llvm::orc::IRCompileLayer CompileLayer;
+  llvm::orc::IRCompileLayer BaselineLayer;
+  llvm::orc::CompileOnDemandLayer CODLayer;
+  // Emits objects on the caller's thread for compileModule.
+  TracingIRCompiler ObjectCompiler;
 
-  RTDyldObjectLinkingLayer ObjectLayer;
-  IRCompileLayer CompileLayer;
+  llvm::orc::JITDylib &MainJD;
 
-  JITDylib &MainJD;
+  CompileMode Mode;
+  llvm::orc::JITTargetMachineBuilder JTMB;
+
+  std::unique_ptr<llvm::orc::IndirectStubsManager> Stubs;
+
+  static void handleLazyCallThroughError() {
+    llvm::errs() << "LazyCallThrough error: Could not find function body";
+    exit(1);
+  }
 
 public:
-  KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
-      : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+  KaleidoscopeJIT(std::unique_ptr<llvm::orc::ExecutionSession> ES,
+                  std::unique_ptr<llvm::orc::EPCIndirectionUtils> EPCIU,
+                  std::unique_ptr<KaleidoscopeObjectCache> ObjCache,
+                  llvm::orc::JITTargetMachineBuilder JTMB, llvm::DataLayout DL,
+                  CompileMode Mode)
+      : ES(std::move(ES)), EPCIU(std::move(EPCIU)), DL(std::move(DL)),
+        Mangle(*this->ES, this->DL), ObjCache(std::move(ObjCache)),
         ObjectLayer(*this->ES,
-                    []() { return std::make_unique<SectionMemoryManager>(); }),
+                    []() {
+                      return std::make_unique<llvm::SectionMemoryManager>();
+                    }),
         CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
-        MainJD(this->ES->createBareJITDylib("<main>")) {
+                     std::make_unique<TracingIRCompiler>(
+                         JTMB, this->ObjCache.get())),
+        BaselineLayer(*this->ES, ObjectLayer,
+                      std::make_unique<TracingIRCompiler>(
+                          llvm::orc::JITTargetMachineBuilder(JTMB)
+                              .setCodeGenOptLevel(
+                                  llvm::CodeGenOptLevel::None))),
+        CODLayer(*this->ES, CompileLayer,
+                 this->EPCIU->getLazyCallThroughManager(),
+                 [this] { return this->EPCIU->createIndirectStubsManager(); }),
+        ObjectCompiler(JTMB, this->ObjCache.get()),
+        MainJD(this->ES->createBareJITDylib("<main>")), Mode(Mode),
+        JTMB(JTMB), Stubs(this->EPCIU->createIndirectStubsManager()) {
     MainJD.addGenerator(
-        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
-            DL.getGlobalPrefix())));
+        llvm::cantFail(llvm::orc::DynamicLibrarySearchGenerator::
+                           GetForCurrentProcess(DL.getGlobalPrefix())));
     if (JTMB.getTargetTriple().isOSBinFormatCOFF()) {
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
@@ -39,55 +145,246 @@ public:
   }
 
   ~KaleidoscopeJIT() {
+    if (auto Err = EPCIU->cleanup())
+      ES->reportError(std::move(Err));
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
-    auto EPC = SelfExecutorProcessControl::Create();
+  static llvm::Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(const JITOptions &Opts = JITOptions()) {
+    auto EPC = llvm::orc::SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
 
-    auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
+    auto ES = std::make_unique<llvm::orc::ExecutionSession>(std::move(*EPC));
+
+    auto EPCIU = llvm::orc::EPCIndirectionUtils::Create(*ES);
+    if (!EPCIU)
+      return EPCIU.takeError();
+
+    (*EPCIU)->createLazyCallThroughManager(
+        *ES, llvm::orc::ExecutorAddr::fromPtr(&handleLazyCallThroughError));
 
-    JITTargetMachineBuilder JTMB(
+    if (auto Err = llvm::orc::setUpInProcessLCTMReentryViaEPCIU(**EPCIU))
+      return std::move(Err);
+
+    llvm::orc::JITTargetMachineBuilder JTMB(
         ES->getExecutorProcessControl().getTargetTriple());
+    if (Opts.CPU.empty()) {
+      auto Host = llvm::orc::JITTargetMachineBuilder::detectHost();
+      if (!Host)
+        return Host.takeError();
+      JTMB = std::move(*Host);
+    } else {
+      // A pinned CPU implies exactly its own features, so the generated code
+      // does not depend on the machine that compiles it.
+      JTMB.setCPU(Opts.CPU);
+    }
+    JTMB.setCodeGenOptLevel(Opts.OptLevel);
 
     auto DL = JTMB.getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
+    // Every thread that compiles creates a TargetMachine of its own; check
+    // here that it can, so that createTargetMachine cannot fail.
+    if (auto TM = JTMB.createTargetMachine(); !TM)
+      return TM.takeError();
+
+    std::unique_ptr<KaleidoscopeObjectCache> ObjCache;
+    if (!Opts.CacheDir.empty()) {
+      auto Cache =
+          KaleidoscopeObjectCache::Create(Opts.CacheDir, JTMB, Opts.OptLevel,
+                                          Opts.CacheSizeLimit);
+      if (!Cache)
+        return Cache.takeError();
+      ObjCache = std::move(*Cache);
+    }
+
+    auto J = std::make_unique<KaleidoscopeJIT>(
+        std::move(ES), std::move(*EPCIU), std::move(ObjCache), std::move(JTMB),
+        std::move(*DL), Opts.Mode);
+    if (Opts.PerfMap)
+      J->ObjectLayer.registerJITEventListener(PerfMapListener::get());
+    if (Opts.JITDump) {
+      auto Listener = llvm::JITEventListener::createPerfJITEventListener();
+      if (!Listener)
+        return llvm::createStringError(llvm::inconvertibleErrorCode(),
+                                 "LLVM was built without perf support");
+      J->ObjectLayer.registerJITEventListener(*Listener);
+    }
+    if (Opts.GDB)
+      J->ObjectLayer.registerJITEventListener(
+          *llvm::JITEventListener::createGDBRegistrationListener());
+    if (Opts.Profile)
+      J->ObjectLayer.registerJITEventListener(SamplingProfiler::get());
+    return J;
+  }
+
+  const llvm::DataLayout &getDataLayout() const { return DL; }
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+  std::unique_ptr<llvm::TargetMachine> createTargetMachine() {
+    return llvm::cantFail(JTMB.createTargetMachine());
   }
 
-  const DataLayout &getDataLayout() const { return DL; }
+  llvm::orc::JITDylib &getMainJITDylib() { return MainJD; }
 
-  JITDylib &getMainJITDylib() { return MainJD; }
+  KaleidoscopeObjectCache *getObjectCache() { return ObjCache.get(); }
 
-  Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
+  llvm::Error addModule(llvm::orc::ThreadSafeModule TSM,
+                        llvm::orc::ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
+    if (Mode == CompileMode::Lazy)
+      return CODLayer.add(RT, std::move(TSM));
     return CompileLayer.add(RT, std::move(TSM));
   }
 
-  Expected<ExecutorSymbolDef> lookup(StringRef Name) {
+  // Compiles TSM to an object file on the calling thread, for addObject.
+  llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>>
+  compileModule(llvm::orc::ThreadSafeModule TSM) {
+    return TSM.withModuleDo(
+        [&](llvm::Module &M) { return ObjectCompiler(M); });
+  }
+
+  // Adds an object file, which is linked when one of its symbols is first
+  // looked up. Symbols it refers to must be defined by then.
+  llvm::Error addObject(std::unique_ptr<llvm::MemoryBuffer> Obj) {
+    return ObjectLayer.add(MainJD, std::move(Obj));
+  }
+
+  // Adds a module to be compiled with the cheapest codegen settings.
+  llvm::Error addBaselineModule(llvm::orc::ThreadSafeModule TSM) {
+    return BaselineLayer.add(MainJD.getDefaultResourceTracker(),
+                             std::move(TSM));
+  }
+
+  // Defines Name in MainJD as an indirect stub jumping to Addr, or repoints
+  // the existing stub. Callers always go through the stub, so they pick up
+  // the new code without being recompiled.
+  llvm::Error setStub(llvm::StringRef Name, llvm::orc::ExecutorAddr Addr) {
+    if (Stubs->findStub(Name, false).getAddress())
+      return Stubs->updatePointer(Name, Addr);
+    if (auto Err = Stubs->createStub(
+            Name, Addr,
+            llvm::JITSymbolFlags::Exported | llvm::JITSymbolFlags::Callable))
+      return Err;
+    return MainJD.define(llvm::orc::absoluteSymbols(
+        {{Mangle(Name.str()), Stubs->findStub(Name, false)}}));
+  }
+
+  // Makes a runtime helper of the host process visible to JIT'd code, without
+  // requiring the embedding executable to export it.
+  llvm::Error defineRuntimeSymbol(llvm::StringRef Name,
+                                  llvm::orc::ExecutorAddr Addr) {
+    return MainJD.define(llvm::orc::absoluteSymbols(
+        {{Mangle(Name.str()),
+          llvm::orc::ExecutorSymbolDef(Addr,
+                                       llvm::JITSymbolFlags::Exported |
+                                           llvm::JITSymbolFlags::Callable)}}));
+  }
+
+  llvm::Expected<llvm::orc::ExecutorSymbolDef> lookup(llvm::StringRef Name) {
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
 };
 
-extern std::unique_ptr<LLVMContext> TheContext;
-extern std::unique_ptr<Module> TheModule;
-extern std::unique_ptr<IRBuilder<>> Builder;
-extern std::map<std::string, Value *> NamedValues;
-extern std::unique_ptr<KaleidoscopeJIT> TheJIT;
-extern std::unique_ptr<FunctionPassManager> TheFPM;
-extern std::unique_ptr<LoopAnalysisManager> TheLAM;
-extern std::unique_ptr<FunctionAnalysisManager> TheFAM;
-extern std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
-extern std::unique_ptr<ModuleAnalysisManager> TheMAM;
-extern std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
-extern std::unique_ptr<StandardInstrumentations> TheSI;
-extern std::map<std::string, ProtoTypeAST> FunctionProtos;
-extern ExitOnError ExitOnErr;
+// What the threads compiling for one engine share. Each of them points
+// TheEngine at it first; codegen state below is per thread.
+struct EngineState {
+  const uint64_t ID = NextID++;
+  std::unique_ptr<KaleidoscopeJIT> JIT;
+  llvm::OptimizationLevel OptLevel = llvm::OptimizationLevel::O2;
+  Verbosity Verbose = Verbosity::Silent;
+  // Record a time trace on every thread that compiles for the engine.
+  bool Trace = false;
+  unsigned TraceGranularity = 0;
+  std::shared_mutex FunctionProtosMutex;
+  std::vector<std::optional<ProtoTypeAST>> FunctionProtos;
+  // The latest definition of every name, for map drivers, the inliner and
+  // memoization; see retainDefinition.
+  std::mutex DefinitionsMutex;
+  std::vector<std::shared_ptr<FuncAST>> Definitions;
+  // Keep every definition, not only those the inliner or Memoize can use.
+  bool RetainDefinitions = false;
+  // Compile every definition with fast-math flags.
+  bool FastMath = false;
+  // Inline retained definitions of at most this many AST nodes into other
+  // modules; see importCallees.
+  unsigned InlineBudget = 0;
+  // Memoize pure recursive definitions in tables of MemoSize entries, which
+  // live as long as the engine.
+  bool Memoize = false;
+  unsigned MemoSize = 4096;
+  std::mutex MemoMutex;
+  std::vector<std::unique_ptr<MemoTable>> MemoTables;
+  // The memoized definitions that call each definition, by its symbol.
+  std::vector<std::vector<Symbol>> MemoDependents;
+  std::unique_ptr<SwapManager> Swap;
+  // Destroyed first, so that background recompilations finish before the
+  // JIT goes away.
+  std::unique_ptr<TierManager> Tier;
+
+private:
+  static inline std::atomic<uint64_t> NextID{1};
+};
+
+extern thread_local EngineState *TheEngine;
+
+// Points TheEngine at an engine for the lifetime of the scope. On a thread
+// that is not tracing yet, also records a time trace for a traced engine; it
+// is handed over to be written out when the scope ends.
+class EngineScope {
+  EngineState *Saved;
+  bool TraceThread = false;
+
+public:
+  EngineScope(EngineState &Engine) : Saved(TheEngine) {
+    TheEngine = &Engine;
+    if (Engine.Trace && !llvm::timeTraceProfilerEnabled()) {
+      llvm::timeTraceProfilerInitialize(Engine.TraceGranularity, "kale");
+      TraceThread = true;
+    }
+  }
+  ~EngineScope() {
+    if (TraceThread)
+      llvm::timeTraceProfilerFinishThread();
+    TheEngine = Saved;
+  }
+};
+
+extern thread_local llvm::orc::ThreadSafeContext TheTSC;
+extern thread_local llvm::LLVMContext *TheContext;
+extern thread_local std::unique_ptr<llvm::Module> TheModule;
+extern thread_local std::unique_ptr<llvm::IRBuilder<>> Builder;
+extern thread_local std::vector<llvm::Value *> NamedValues;
+extern thread_local std::unique_ptr<llvm::TargetMachine> TheTM;
+extern thread_local std::unique_ptr<llvm::ModulePassManager> TheMPM;
+extern thread_local std::unique_ptr<llvm::LoopAnalysisManager> TheLAM;
+extern thread_local std::unique_ptr<llvm::FunctionAnalysisManager> TheFAM;
+extern thread_local std::unique_ptr<llvm::CGSCCAnalysisManager> TheCGAM;
+extern thread_local std::unique_ptr<llvm::ModuleAnalysisManager> TheMAM;
+extern thread_local std::unique_ptr<llvm::PassInstrumentationCallbacks> ThePIC;
+extern thread_local std::unique_ptr<llvm::StandardInstrumentations> TheSI;
+extern llvm::ExitOnError ExitOnErr;
+void addFunctionProto(const ProtoTypeAST &Proto);
+// The prototype of Name, if TheEngine has one.
+std::optional<ProtoTypeAST> getFunctionProto(Symbol Name);
+// Opens a new context with fresh pass and analysis managers, then a module in
+// it. Creates TheTM from TheEngine's JIT unless the caller has already set it.
 void InitializeModuleAndManagers();
+// Calls InitializeModuleAndManagers unless this thread already has a module
+// for TheEngine.
+void EnsureModule();
+// Opens a new module in the current context, keeping the managers.
+void InitializeModule();
+// Hands TheModule to the JIT, sharing the context with later modules.
+llvm::orc::ThreadSafeModule TakeModule();
+// Runs TheMPM over TheModule.
+void OptimizeModule();
+// Runs the standard pipeline for Level over M with throwaway managers.
+void OptimizeModule(llvm::Module &M, llvm::OptimizationLevel Level);
+// The IR pipeline and codegen levels of the drivers' -O<Level>, or none if
+// Level is not a digit from 0 to 3.
+std::optional<std::pair<llvm::OptimizationLevel, llvm::CodeGenOptLevel>>
+getOptLevels(char Level);
@@ -0,0 +1,197 @@
+#pragma once
+
+#include "ast.h"
+#include "buffer.h"
+#include "jit.h"
+#include "map.h"
+
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+// The embedding interface of libkale. An Engine owns a JIT and everything
+// that is shared between the threads compiling for it; codegen itself uses
+// per-thread state, so any number of threads may call into the same Engine.
+namespace kale {
+
+struct EngineOptions : JITOptions {
+  // Level of the IR pipeline run over every module.
+  llvm::OptimizationLevel IROptLevel = llvm::OptimizationLevel::O2;
+  // Calls after which CompileMode::Tiered recompiles a function at -O3.
+  unsigned TierThreshold = 1000;
+  // Collect a thread's definitions into one module in a reused context, and
+  // only hand it to the JIT when that thread evaluates an expression.
+  // Requires CompileMode::Eager.
+  bool Batch = false;
+  // Compile runs of definitions on a thread pool of Threads threads (0: one
+  // per core) before the next expression is evaluated. Requires
+  // CompileMode::Eager or CompileMode::Lazy.
+  bool Parallel = false;
+  unsigned Threads = 0;
+  // Compile and emit every definition on the same pool as soon as it is
+  // added, while the caller goes on parsing, and link the objects in the
+  // order of the definitions. An expression only waits for the definitions
+  // it calls. Requires CompileMode::Eager and no Batch.
+  bool Pipeline = false;
+  // Evaluate top-level expressions without loops and with at most
+  // InterpretLimit nodes with the Bytecode interpreter instead of the JIT.
+  bool Interpret = true;
+  unsigned InterpretLimit = 1000;
+  // Compile every def as if it were declared `def fast`: with all fast-math
+  // flags, so that reductions vectorize and multiplies and adds contract.
+  bool FastMath = false;
+  // Let the inliner see the bodies of earlier defs with at most this many
+  // AST nodes (0: never).
+  unsigned InlineBudget = 40;
+  // Keep the AST of every def, for map. Otherwise only the defs that the
+  // inliner or Memoize can use are kept past their codegen.
+  bool RetainDefinitions = false;
+  // Wrap every pure recursive def in a table of its last MemoSize distinct
+  // results; see shouldMemoize. In tiered and swap mode, redefining a def
+  // compiles the memoized defs that call it again, with new tables.
+  bool Memoize = false;
+  unsigned MemoSize = 4096;
+  // What to print to stderr while compiling; nothing by default.
+  Verbosity Verbose = Verbosity::Silent;
+  // Write a Chrome trace of every compile phase, per definition, to this
+  // file when the Engine is destroyed. The Engine must be created and
+  // destroyed on the same thread, which must not be tracing already.
+  std::string TraceFile;
+  // Events shorter than this many microseconds are left out of the trace.
+  unsigned TraceGranularity = 0;
+};
+
+// A `buf` argument. The host keeps the elements and the descriptor alive,
+// and the descriptor unchanged, for the duration of the call.
+using Buffer = KaleBuffer;
+
+template <typename T> constexpr NumType getNumType() {
+  static_assert(std::is_same_v<T, double> || std::is_same_v<T, float> ||
+                    std::is_same_v<T, int64_t> || std::is_same_v<T, Buffer *>,
+                "kale values are doubles, floats, int64_ts and Buffer *s");
+  if constexpr (std::is_same_v<T, float>)
+    return NumType::F32;
+  else if constexpr (std::is_same_v<T, int64_t>)
+    return NumType::I64;
+  else if constexpr (std::is_same_v<T, Buffer *>)
+    return NumType::Buf;
+  else
+    return NumType::F64;
+}
+
+template <typename Signature> class Fn;
+
+// A compiled function with a C++ signature. Calling it is a plain indirect
+// call, with no lock on the way; it stays valid as long as its Engine. In
+// lazy, tiered and swap mode the address is a stub, so calls through an old
+// handle reach the latest code, which tiered and swap mode keep to the same
+// types.
+template <typename Ret, typename... Args> class Fn<Ret(Args...)> {
+public:
+  using Pointer = Ret (*)(Args...);
+  static constexpr size_t Arity = sizeof...(Args);
+  static constexpr std::array<NumType, Arity> Params = {
+      getNumType<Args>()...};
+  static constexpr NumType Result = getNumType<Ret>();
+  static_assert(Result != NumType::Buf, "kale functions do not return bufs");
+
+  Fn() = default;
+  explicit Fn(Pointer Ptr) : Ptr(Ptr) {}
+
+  Ret operator()(Args... args) const { return Ptr(args...); }
+  explicit operator bool() const { return Ptr; }
+  Pointer get() const { return Ptr; }
+
+private:
+  Pointer Ptr = nullptr;
+};
+
+class Engine {
+  EngineOptions Opts;
+  EngineState State;
+  std::mutex PendingMutex;
+  std::vector<std::shared_ptr<FuncAST>> PendingDefs;
+  // The names that have a definition, unless definitions can be replaced.
+  std::mutex DefinedMutex;
+  std::vector<bool> Defined;
+  // Pipelined definitions take tickets in the order they are added. The
+  // objects are linked in ticket order, so that the callees of a definition
+  // are defined when it is linked.
+  std::mutex PipelineMutex;
+  std::condition_variable PipelineLinked;
+  uint64_t Issued = 0;
+  uint64_t Linked = 0;
+  // One past the ticket of the latest definition of every name.
+  std::vector<uint64_t> Tickets;
+  // The names that the latest definition of every name calls.
+  std::vector<std::vector<Symbol>> PipelineCallees;
+  llvm::Error PipelineErrors = llvm::Error::success();
+  std::unique_ptr<llvm::ThreadPool> Pool;
+
+  explicit Engine(const EngineOptions &Opts);
+
+  llvm::Error publishDefinition(std::shared_ptr<FuncAST> ast);
+  llvm::Error compileDefinition(FuncAST &Def);
+  void pipelineDefinition(FuncAST &Def, uint64_t Ticket);
+  llvm::Error waitForCallees(const ExprAST *E);
+  llvm::Error flushBatch();
+  llvm::Expected<llvm::orc::ExecutorAddr>
+  lookupFunction(llvm::StringRef Name, llvm::ArrayRef<NumType> Params,
+                 NumType Result);
+
+public:
+  static llvm::Expected<std::unique_ptr<Engine>>
+  create(const EngineOptions &Opts);
+  ~Engine();
+
+  // Compiles every ext and def in Source, and evaluates its top-level
+  // expressions for their side effects.
+  llvm::Error compile(llvm::StringRef Source);
+
+  // Entry points for front ends that parse on their own. A definition or
+  // expression that reads an unbound variable, calls an unknown function or
+  // calls one with the wrong number of arguments, or uses a buf other than
+  // by indexing it, passing it to len or passing it as a buf, is an error.
+  void addExtern(const ProtoTypeAST &Proto);
+  llvm::Error addDefinition(FuncAST Def);
+  llvm::Expected<double> evaluate(FuncAST Expr);
+
+  // Compiles queued definitions: those of --parallel runs, pipelined ones,
+  // and the calling thread's --batch module.
+  llvm::Error flush();
+
+  std::optional<ProtoTypeAST> getPrototype(llvm::StringRef Name);
+
+  // Looks up a def or ext with the types of Signature.
+  template <typename Signature>
+  llvm::Expected<Fn<Signature>> lookup(llvm::StringRef Name);
+
+  // Compiles a driver applying Name over columns; see compileMap. Requires
+  // RetainDefinitions.
+  llvm::Expected<MapFunction> map(llvm::StringRef Name);
+
+  // Prints the hit rate of the tables of memoized defs, if there are any.
+  void printMemoStats(llvm::raw_ostream &OS);
+
+  // Prints the redefinition latency and freed code of CompileMode::Swap.
+  void printSwapStats(llvm::raw_ostream &OS);
+
+  KaleidoscopeObjectCache *getObjectCache() {
+    return State.JIT->getObjectCache();
+  }
+};
+
+template <typename Signature>
+llvm::Expected<Fn<Signature>> Engine::lookup(llvm::StringRef Name) {
+  using F = Fn<Signature>;
+  auto Addr = lookupFunction(Name, F::Params, F::Result);
+  if (!Addr)
+    return Addr.takeError();
+  return F(Addr->template toPtr<typename F::Pointer>());
+}
+
+} // namespace kale
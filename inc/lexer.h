@@ -1,8 +1,19 @@
 #pragma once
 
 #include <cassert>
-#include <cstdlib>
+#include <charconv>
+#include <iostream>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/StringSwitch.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Process.h>
+#include <memory>
 #include <string>
+#include <system_error>
+
+#include "symbol.h"
 
 enum Token {
   tok_eof = -1,
@@ -21,15 +32,89 @@ enum Token {
   tok_else = -8,
   tok_for = -9,
   tok_in = -10,
+  tok_pfor = -11,
+  tok_reduce = -12,
 };
 
+// Tokens are scanned from the contiguous range [Cur, End). Files are mapped
+// (or read) into Buffer in one go. Standard input is read as it arrives, so
+// that the REPL, or a co-process writing to a pipe, gets its answers as soon
+// as a line is complete: a terminal a line at a time, anything else in large
+// blocks that end at a line end. Either way a token never spans lines.
 struct Lexer {
-  std::string id;
+  // Bytes asked of standard input per read.
+  static constexpr size_t BlockSize = 64 << 10;
+
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  std::string Line;
+  const char *Cur = nullptr;
+  const char *End = nullptr;
+  bool Stdin = false;
+  bool Interactive = false;
+
+  // The spelling of the current identifier, valid until the next token, and
+  // its interned symbol.
+  llvm::StringRef id;
+  Symbol sym;
   double num;
-  int ch = ' ';
   Token tok;
 
-  Lexer() { getNextToken(); }
+  // Lexes Filename, or standard input when it is "-".
+  std::error_code open(llvm::StringRef Filename) {
+    if (Filename == "-") {
+      Stdin = true;
+      Interactive = llvm::sys::Process::StandardInIsUserInput();
+      return {};
+    }
+    auto BufOrErr =
+        llvm::MemoryBuffer::getFile(Filename, /*IsText=*/false,
+                                    /*RequiresNullTerminator=*/false);
+    if (!BufOrErr)
+      return BufOrErr.getError();
+    Buffer = std::move(*BufOrErr);
+    Cur = Buffer->getBufferStart();
+    End = Buffer->getBufferEnd();
+    return {};
+  }
+
+  // Lexes Source, which must stay alive while it is being parsed.
+  void openBuffer(llvm::StringRef Source) {
+    Cur = Source.begin();
+    End = Source.end();
+  }
+
+  bool refill() {
+    if (!Stdin)
+      return false;
+    if (Interactive) {
+      if (!std::getline(std::cin, Line))
+        return false;
+      Line += '\n';
+    } else {
+      // Take whatever the pipe holds, and wait for more only to complete the
+      // last line.
+      Line.clear();
+      do {
+        auto Size = Line.size();
+        Line.resize(Size + BlockSize);
+        auto Read = llvm::sys::fs::readNativeFile(
+            llvm::sys::fs::getStdinHandle(),
+            llvm::MutableArrayRef<char>(Line.data() + Size, BlockSize));
+        Line.resize(Size + (Read ? *Read : 0));
+        if (!Read) {
+          llvm::consumeError(Read.takeError());
+          break;
+        }
+        if (!*Read)
+          break;
+      } while (Line.back() != '\n');
+      if (Line.empty())
+        return false;
+    }
+    Cur = Line.data();
+    End = Cur + Line.size();
+    return true;
+  }
 
   bool isBinOp() {
     switch (int(tok)) {
@@ -72,9 +157,9 @@ struct Lexer {
     return false;
   }
 
-  std::string consumeId() {
+  Symbol consumeId() {
     assert(tok == tok_id);
-    auto res = id;
+    auto res = sym;
     getNextToken();
     return res;
   }
@@ -95,42 +180,46 @@ struct Lexer {
   }
 
   int getNextToken() {
-    while (std::isspace(ch))
-      ch = getchar();
-    if (ch == '#') {
-      while (ch != EOF && ch != '\n')
-        ch = getchar();
-      return getNextToken();
+    while (true) {
+      if (Cur == End && !refill())
+        return tok = tok_eof;
+      if (llvm::isSpace(*Cur)) {
+        ++Cur;
+      } else if (*Cur == '#') {
+        while (Cur != End && *Cur != '\n')
+          ++Cur;
+      } else {
+        break;
+      }
     }
-    if (std::isalpha(ch)) {
-      id.clear();
-      while (std::isalnum(ch))
-        id += ch, ch = getchar();
-      if (id == "def")
-        return tok = tok_def;
-      if (id == "ext")
-        return tok = tok_ext;
-      if (id == "if")
-        return tok = tok_if;
-      if (id == "then")
-        return tok = tok_then;
-      if (id == "else")
-        return tok = tok_else;
-      if (id == "for")
-        return tok = tok_for;
-      if (id == "in")
-        return tok = tok_in;
-      return tok = tok_id;
+    auto Start = Cur;
+    if (llvm::isAlpha(*Cur)) {
+      do
+        ++Cur;
+      while (Cur != End && llvm::isAlnum(*Cur));
+      id = llvm::StringRef(Start, Cur - Start);
+      tok = llvm::StringSwitch<Token>(id)
+                .Case("def", tok_def)
+                .Case("ext", tok_ext)
+                .Case("if", tok_if)
+                .Case("then", tok_then)
+                .Case("else", tok_else)
+                .Case("for", tok_for)
+                .Case("in", tok_in)
+                .Case("pfor", tok_pfor)
+                .Case("reduce", tok_reduce)
+                .Default(tok_id);
+      if (tok == tok_id)
+        sym = Symbols.intern(id);
+      return tok;
     }
-    if (std::isdigit(ch)) {
-      std::string nu;
-      while (std::isdigit(ch) || ch == '.')
-        nu += ch, ch = getchar();
-      num = std::strtod(nu.c_str(), 0);
+    if (llvm::isDigit(*Cur)) {
+      do
+        ++Cur;
+      while (Cur != End && (llvm::isDigit(*Cur) || *Cur == '.'));
+      std::from_chars(Start, Cur, num);
       return tok = tok_num;
     }
-    tok = Token(ch);
-    ch = getchar();
-    return tok;
+    return tok = Token(static_cast<unsigned char>(*Cur++));
   }
 };
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "ast.h"
+#include "llvm.h"
+
+#include <cstdint>
+#include <memory>
+
+// Batch evaluation of a definition over columns of doubles. The generated
+// driver computes Out[i] = f(Columns[0][i], ..., Columns[n-1][i]) for every
+// row i < Rows. Out must not overlap any column.
+using MapFunction = void (*)(const double *const *Columns, double *Out,
+                             uint64_t Rows);
+
+// Keeps the AST of a definition in TheEngine, so that map drivers and the
+// modules of other definitions can inline it. Replaces any earlier
+// definition of the same name. Unless TheEngine retains every definition or
+// memoizes, a definition that is too large to inline is dropped instead, so
+// that its arena is freed after codegen. Returns the definition replaced.
+std::shared_ptr<FuncAST> retainDefinition(std::shared_ptr<FuncAST> Def);
+// Makes Def, which may be null, the retained definition of Name again, after
+// the JIT rejected the one that replaced it. Returns the definition replaced.
+std::shared_ptr<FuncAST> restoreDefinition(Symbol Name,
+                                           std::shared_ptr<FuncAST> Def);
+// The latest definition of Name in TheEngine, or null for an ext or a
+// definition that was not retained.
+std::shared_ptr<FuncAST> getDefinition(Symbol Name);
+
+// Compiles the retained definitions that TheModule only declares and that
+// have at most TheEngine->InlineBudget AST nodes, no pfor and no call of
+// themselves, as available_externally bodies, so that the inliner can use
+// them while the JIT still links calls to the published code. Repeats for
+// the callees of the imported bodies, and returns the definitions imported.
+llvm::SmallVector<std::shared_ptr<FuncAST>, 4> importCallees();
+
+// Compiles the map driver of the definition Name in TheEngine. The definition
+// and every retained definition it calls are compiled again into the driver's
+// module with internal linkage, so that the -O3 pipeline can inline them into
+// the row loop and vectorize it.
+llvm::Expected<MapFunction> compileMap(Symbol Name);
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "ast.h"
+#include "llvm.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// The results of a memoized definition (--memoize), in a direct-mapped table
+// keyed on the bit patterns of the arguments. Every entry is a run of
+// 2 + Arity words, a sequence number, the result and the arguments, so a
+// lookup touches one or two cache lines. An entry is overwritten by the next
+// result that hashes to it, which bounds the table, and is guarded by its
+// sequence number, so that any number of threads can use the table without
+// a lock.
+class MemoTable {
+public:
+  MemoTable(std::string Name, unsigned Arity, unsigned Size);
+
+  // Sets Value and returns true if the result for Args is in the table.
+  bool lookup(const double *Args, double &Value);
+  // Records Value as the result for Args, unless a store to the same entry is
+  // in progress.
+  void store(const double *Args, double Value);
+
+  const std::string Name;
+  const unsigned Arity;
+  std::atomic<uint64_t> Hits{0};
+  std::atomic<uint64_t> Misses{0};
+
+private:
+  uint64_t Mask;
+  std::unique_ptr<std::atomic<uint64_t>[]> Entries;
+
+  std::atomic<uint64_t> *getEntry(const double *Args);
+};
+
+// Called by memoized definitions.
+extern "C" int32_t kale_memo_lookup(MemoTable *Table, const double *Args,
+                                    double *Value);
+extern "C" void kale_memo_store(MemoTable *Table, const double *Args,
+                                double Value);
+
+// Whether Def is worth memoizing: it takes and returns f64, calls itself,
+// directly or through other definitions, and calls no ext, even
+// transitively, so that its result depends on its arguments alone. Callees
+// are looked up among the retained definitions of TheEngine. If it is, the
+// other definitions it calls, directly or not, are added to Callees.
+bool shouldMemoize(const FuncAST &Def,
+                   llvm::SmallVectorImpl<Symbol> *Callees = nullptr);
+
+// Moves the body of F to an internal function and makes F return the result
+// from a new table of TheEngine when it has one, or call the body and record
+// it. Recursive calls still go through F, so each distinct call is computed
+// once. F is the definition Name, whose table depends on the current
+// definitions of Callees; see takeMemoDependents.
+void memoize(llvm::Function *F, Symbol Name, llvm::ArrayRef<Symbol> Callees);
+
+// The memoized definitions whose tables hold results computed with the
+// current definition of Name, which TheEngine then forgets. A redefinition of
+// Name must compile them again, so that they get new tables and are checked
+// for purity again.
+std::vector<Symbol> takeMemoDependents(Symbol Name);
+
+// Prints the hit rate of every table of TheEngine.
+void printMemoStats(llvm::raw_ostream &OS);
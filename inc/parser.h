@@ -3,19 +3,35 @@
 #include "ast.h"
 #include "lexer.h"
 
+#include <chrono>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/TimeProfiler.h>
 #include <memory>
+#include <optional>
 
 struct Parser : Lexer {
-  ExprPtr parseNumExpr() { return std::make_unique<NumExprAST>(consumeNum()); }
+  // Expression nodes of the definition being parsed are allocated here.
+  std::unique_ptr<ASTArena> Arena;
 
-  ExprPtr parseVarOrCallExpr() {
+  ExprAST *parseNumExpr() { return Arena->create<NumExprAST>(consumeNum()); }
+
+  ExprAST *parseVarOrCallExpr() {
     auto name = consumeId();
+    if (tryConsume('[')) {
+      auto index = parseExpr();
+      if (!index || !tryConsume(']'))
+        return nullptr;
+      ExprAST *value = nullptr;
+      if (tryConsume('=') && !(value = parseExpr()))
+        return nullptr;
+      return Arena->create<IndexExprAST>(name, index, value);
+    }
     if (tryConsume('(')) {
-      ExprVec arguments;
+      llvm::SmallVector<ExprAST *, 8> arguments;
       if (!tryConsume(')')) {
         while (true) {
           if (auto arg = parseExpr()) {
-            arguments.push_back(std::move(arg));
+            arguments.push_back(arg);
             if (tryConsume(')'))
               break;
             if (tryConsume(','))
@@ -26,29 +42,27 @@ struct Parser : Lexer {
           }
         }
       }
-      return std::make_unique<CallExprAST>(std::move(name),
-                                           std::move(arguments));
+      return Arena->create<CallExprAST>(name, Arena->save(arguments));
     } else {
-      return std::make_unique<VarExprAST>(std::move(name));
+      return Arena->create<VarExprAST>(name);
     }
   }
 
-  ExprPtr parseIfExpr() {
+  ExprAST *parseIfExpr() {
     consume(tok_if);
     if (auto Cond = parseExpr()) {
       consume(tok_then);
       if (auto Then = parseExpr()) {
         consume(tok_else);
         if (auto Else = parseExpr()) {
-          return std::make_unique<IfExprAST>(std::move(Cond), std::move(Then),
-                                             std::move(Else));
+          return Arena->create<IfExprAST>(Cond, Then, Else);
         }
       }
     }
     return nullptr;
   }
 
-  ExprPtr parseForExpr() {
+  ExprAST *parseForExpr() {
     consume(tok_for);
     auto name = consumeId();
     consume('=');
@@ -59,16 +73,40 @@ struct Parser : Lexer {
         if (auto Next = parseExpr()) {
           consume(tok_in);
           if (auto Body = parseExpr())
-            return std::make_unique<ForExprAST>(
-                std::move(name), std::move(Init), std::move(Cond),
-                std::move(Next), std::move(Body));
+            return Arena->create<ForExprAST>(name, Init, Cond, Next, Body);
         }
       }
     }
     return nullptr;
   }
 
-  ExprPtr parseParenExpr() {
+  ExprAST *parsePForExpr() {
+    consume(tok_pfor);
+    auto name = consumeId();
+    consume('=');
+    auto Begin = parseExpr();
+    if (!Begin || !tryConsume(','))
+      return nullptr;
+    auto End = parseExpr();
+    if (!End)
+      return nullptr;
+    ExprAST *Chunk = nullptr;
+    if (tryConsume(',') && !(Chunk = parseExpr()))
+      return nullptr;
+    char Reduce = 0;
+    if (tryConsume(tok_reduce)) {
+      if (getToken() != '+' && getToken() != '*')
+        return nullptr;
+      Reduce = popToken();
+    }
+    if (!tryConsume(tok_in))
+      return nullptr;
+    if (auto Body = parseExpr())
+      return Arena->create<PForExprAST>(name, Begin, End, Chunk, Reduce, Body);
+    return nullptr;
+  }
+
+  ExprAST *parseParenExpr() {
     consume('(');
     if (auto expr = parseExpr()) {
       consume(')');
@@ -78,7 +116,7 @@ struct Parser : Lexer {
     }
   }
 
-  ExprPtr parsePrimaryExpr() {
+  ExprAST *parsePrimaryExpr() {
     switch (getToken()) {
     case tok_num:
       return parseNumExpr();
@@ -88,6 +126,8 @@ struct Parser : Lexer {
       return parseIfExpr();
     case tok_for:
       return parseForExpr();
+    case tok_pfor:
+      return parsePForExpr();
     case '(':
       return parseParenExpr();
     default:
@@ -95,12 +135,12 @@ struct Parser : Lexer {
     }
   }
 
-  ExprPtr parseBinExpr(ExprPtr lhs, int prec) {
+  ExprAST *parseBinExpr(ExprAST *lhs, int prec) {
     while (isBinOp() && prec < getOpPrec()) {
       int newPrec = getOpPrec();
       char op = popToken();
       if (auto rhs = parseExpr(newPrec)) {
-        lhs = std::make_unique<BinExprAST>(op, std::move(lhs), std::move(rhs));
+        lhs = Arena->create<BinExprAST>(op, lhs, rhs);
       } else {
         return nullptr;
       }
@@ -108,21 +148,51 @@ struct Parser : Lexer {
     return lhs;
   }
 
-  ExprPtr parseExpr(int prec = 0) {
+  ExprAST *parseExpr(int prec = 0) {
     if (auto lhs = parsePrimaryExpr()) {
-      return parseBinExpr(std::move(lhs), prec);
+      return parseBinExpr(lhs, prec);
     } else {
       return nullptr;
     }
   }
 
-  ProtoTypeAST parseProtoType() {
-    auto name = consumeId();
-    std::vector<std::string> parameters;
+  // Parses the `: type` annotation, if any, after a parameter or prototype.
+  // An unknown type is a syntax error.
+  std::optional<NumType> parseTypeAnnotation() {
+    static Symbol F64 = Symbols.intern("f64");
+    static Symbol F32 = Symbols.intern("f32");
+    static Symbol I64 = Symbols.intern("i64");
+    static Symbol Buf = Symbols.intern("buf");
+    if (!tryConsume(':'))
+      return NumType::F64;
+    auto type = consumeId();
+    if (type == F32)
+      return NumType::F32;
+    if (type == I64)
+      return NumType::I64;
+    if (type == Buf)
+      return NumType::Buf;
+    if (type == F64)
+      return NumType::F64;
+    return std::nullopt;
+  }
+
+  std::optional<ProtoTypeAST> parseProtoType() {
+    return parseProtoType(consumeId());
+  }
+
+  // Parses the rest of a prototype, after its name.
+  std::optional<ProtoTypeAST> parseProtoType(Symbol name) {
+    std::vector<Symbol> parameters;
+    std::vector<NumType> types;
     consume('(');
     if (!tryConsume(')')) {
       while (true) {
         parameters.push_back(consumeId());
+        auto type = parseTypeAnnotation();
+        if (!type)
+          return std::nullopt;
+        types.push_back(*type);
         if (tryConsume(')'))
           break;
         if (tryConsume(','))
@@ -130,18 +200,54 @@ struct Parser : Lexer {
         assert(0);
       }
     }
-    return ProtoTypeAST(std::move(name), std::move(parameters));
+    ProtoTypeAST proto(name, std::move(parameters));
+    proto.types = std::move(types);
+    // A buf cannot be returned.
+    auto result = parseTypeAnnotation();
+    if (!result || *result == NumType::Buf)
+      return std::nullopt;
+    proto.result = *result;
+    return proto;
   }
 
-  ProtoTypeAST parseExt() {
+  std::optional<ProtoTypeAST> parseExt() {
+    auto Start = std::chrono::steady_clock::now();
     consume(tok_ext);
-    return parseProtoType();
+    auto proto = parseProtoType();
+    TheASTStats.addParse(Start);
+    return proto;
   }
 
   FuncAST parseFunc() {
+    auto Start = std::chrono::steady_clock::now();
     consume(tok_def);
-    auto proto = parseProtoType();
+    // `def fast f(x)` compiles f with fast-math flags, while `def fast(x)`
+    // defines a function named fast.
+    static Symbol Fast = Symbols.intern("fast");
+    auto name = consumeId();
+    bool fast = name == Fast && getToken() == tok_id;
+    if (fast)
+      name = consumeId();
+    auto proto = parseProtoType(name);
+    // Like a malformed body, a malformed prototype leaves the def without one.
+    if (!proto)
+      return FuncAST(ProtoTypeAST(name, {}), nullptr, nullptr);
+    proto->fast = fast;
+    llvm::TimeTraceScope Trace("Parse", name.str());
+    Arena = std::make_unique<ASTArena>();
+    auto body = parseExpr();
+    TheASTStats.addParse(Start, Arena->Nodes, Arena->Bytes);
+    return FuncAST(std::move(*proto), std::move(Arena), body);
+  }
+
+  // Wraps a top-level expression into the anonymous function `_expr_`.
+  FuncAST parseTopLevelExpr() {
+    auto Start = std::chrono::steady_clock::now();
+    llvm::TimeTraceScope Trace("Parse", "_expr_");
+    Arena = std::make_unique<ASTArena>();
     auto body = parseExpr();
-    return FuncAST(std::move(proto), std::move(body));
+    TheASTStats.addParse(Start, Arena->Nodes, Arena->Bytes);
+    static Symbol Expr = Symbols.intern("_expr_");
+    return FuncAST(ProtoTypeAST(Expr, {}), std::move(Arena), body);
   }
 };
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdint>
+
+// Runtime of `pfor`. The loop body is outlined into a chunk function that
+// runs the iterations [Begin, End) and returns their reduction, or 0.0 when
+// the loop has none. Env holds the values the body captured.
+using PForChunk = double (*)(const double *Env, int64_t Begin, int64_t End);
+
+// Runs Chunk over [Begin, End) in chunks of ChunkSize iterations (0: pick one
+// from the trip count and the number of workers) on the process-wide
+// work-stealing pool, and returns the partial results combined in chunk order
+// with Reduce ('+' or '*'), or 0.0 when Reduce is 0. The calling thread takes
+// part, so nested loops cannot deadlock the pool.
+extern "C" double kale_pfor(PForChunk Chunk, const double *Env, int64_t Begin,
+                            int64_t End, int64_t ChunkSize, int32_t Reduce);
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "llvm.h"
+
+#include <cstdint>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Writes /tmp/perf-<pid>.map, from which `perf report` names the functions of
+// JIT'd code. Unlike a jitdump it needs no `perf inject`, but it does not
+// allow annotating their instructions.
+class PerfMapListener : public llvm::JITEventListener {
+  std::mutex Mutex;
+  std::unique_ptr<llvm::raw_fd_ostream> Out;
+
+public:
+  static PerfMapListener &get();
+
+  void
+  notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile &Obj,
+                     const llvm::RuntimeDyld::LoadedObjectInfo &L) override;
+};
+
+// A sampling profiler for JIT'd code. While it runs, SIGPROF interrupts the
+// process at a fixed rate of CPU time and the signal handler records the
+// interrupted program counter. Samples are attributed to the JIT'd functions
+// loaded at the time, or to the host function containing them, before the
+// code they point into is freed. The profiler is process-wide, since the
+// timer is.
+class SamplingProfiler : public llvm::JITEventListener {
+  struct Function {
+    uint64_t End;
+    std::string Name;
+  };
+
+  std::mutex Mutex;
+  // Loaded JIT'd functions by start address, and the start addresses of the
+  // functions of every object.
+  std::map<uint64_t, Function> Functions;
+  llvm::DenseMap<ObjectKey, std::vector<uint64_t>> Objects;
+  llvm::StringMap<uint64_t> Counts;
+  uint64_t Attributed = 0;
+  unsigned Frequency = 0;
+  // Drains the samples periodically while the timer runs.
+  bool Running = false;
+  std::condition_variable Wake;
+  std::thread Drainer;
+
+  SamplingProfiler() = default;
+  ~SamplingProfiler() { stop(); }
+  // Attributes the samples recorded so far. Requires Mutex.
+  void drain();
+
+public:
+  static SamplingProfiler &get();
+
+  // Starts sampling every thread Rate times per second of CPU time.
+  llvm::Error start(unsigned Rate);
+  void stop();
+
+  // Prints the Top functions by samples.
+  void report(llvm::raw_ostream &OS, unsigned Top = 20);
+
+  void
+  notifyObjectLoaded(ObjectKey K, const llvm::object::ObjectFile &Obj,
+                     const llvm::RuntimeDyld::LoadedObjectInfo &L) override;
+  void notifyFreeingObject(ObjectKey K) override;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "map.h"
+
+#include <cstdint>
+#include <string>
+
+// Evaluation of a map driver over files of any size. The input is
+// memory-mapped and processed in windows, whose results are written out
+// before the next window is read, so memory use is bounded by the window
+// whatever the size of the file. Each window is split into cache-sized
+// chunks that run in parallel on the pfor workers.
+enum class InputFormat { Columns, CSV };
+
+struct StreamOptions {
+  // Bytes of input and results per chunk, and of input per window.
+  uint64_t ChunkBytes = 256 << 10;
+  uint64_t WindowBytes = 16 << 20;
+};
+
+struct StreamStats {
+  uint64_t Rows = 0;
+  uint64_t BytesIn = 0;
+  uint64_t BytesOut = 0;
+};
+
+// Writes Map over the rows of Inputs, files of native-endian doubles with one
+// column each, to Output as native-endian doubles.
+llvm::Expected<StreamStats> streamColumns(MapFunction Map,
+                                          llvm::ArrayRef<std::string> Inputs,
+                                          llvm::StringRef Output,
+                                          const StreamOptions &Opts = {});
+
+// Writes Map over the lines of a CSV file of Arity numbers per line to Output
+// as native-endian doubles. Blank lines are skipped, and so is a first line
+// that is not a row of numbers, taking it for a header.
+llvm::Expected<StreamStats> streamCSV(MapFunction Map, unsigned Arity,
+                                      llvm::StringRef Input,
+                                      llvm::StringRef Output,
+                                      const StreamOptions &Opts = {});
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "ast.h"
+#include "llvm.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+struct EngineState;
+
+// Hot-swappable definitions. Every definition is compiled into
+// `name$v<version>` under a ResourceTracker of its own and published through
+// the indirect stub `name`, through which every caller goes. A redefinition
+// repoints the stub, so callers are neither recompiled nor left on the old
+// code, and retires the previous version. A redefinition must therefore keep
+// the parameter and result types. Retired code is freed once every
+// evaluation that was running when it was retired has returned. Calls through
+// Fn handles are not tracked: the host must not redefine a function while it
+// calls it that way.
+class SwapManager {
+private:
+  struct Definition {
+    // The latest version started, and the version the stub points to.
+    uint64_t Started = 0;
+    uint64_t Version = 0;
+    llvm::orc::ResourceTrackerSP Code;
+    // The prototype of the version the stub points to.
+    std::optional<ProtoTypeAST> Proto;
+  };
+
+  EngineState &Engine;
+  std::mutex Lock;
+  llvm::StringMap<Definition> Definitions;
+  // Bumped by every retirement. Running counts the evaluations in progress
+  // by the epoch they started in; Retired holds trackers in epoch order.
+  uint64_t Epoch = 0;
+  std::map<uint64_t, unsigned> Running;
+  std::vector<std::pair<uint64_t, llvm::orc::ResourceTrackerSP>> Retired;
+  uint64_t Freed = 0;
+  uint64_t Redefinitions = 0;
+  double RedefineSeconds = 0;
+  double MaxRedefineSeconds = 0;
+
+  // Compiles a new version of a definition and points its stub at it.
+  llvm::Error addVersion(std::shared_ptr<FuncAST> ast);
+  // Frees the retired code that no running evaluation can be in.
+  llvm::Error collect();
+
+public:
+  explicit SwapManager(EngineState &Engine) : Engine(Engine) {}
+
+  // Compiles a definition and points its stub at it, then swaps the
+  // memoized definitions that call it for versions with new tables. A
+  // redefinition that changes the parameter or result types is an error.
+  // The caller's TheEngine must be Engine.
+  llvm::Error addDefinition(std::shared_ptr<FuncAST> ast);
+
+  // Brackets an evaluation that may run compiled code.
+  uint64_t enter();
+  llvm::Error leave(uint64_t Started);
+
+  // Prints the number and latency of redefinitions and the versions freed.
+  void printStats(llvm::raw_ostream &OS);
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <memory>
+#include <mutex>
+#include <ostream>
+
+// An interned identifier. Two Symbols are equal iff their spellings are, and
+// their ids are small and dense, so tables keyed by identifiers can be plain
+// vectors indexed by id().
+class Symbol {
+  uint32_t ID = 0;
+
+public:
+  Symbol() = default;
+  explicit Symbol(uint32_t ID) : ID(ID) {}
+  uint32_t id() const { return ID; }
+  llvm::StringRef str() const;
+  bool operator==(Symbol Other) const { return ID == Other.ID; }
+  bool operator!=(Symbol Other) const { return ID != Other.ID; }
+};
+
+// Interning takes a lock, but looking a spelling up does not: spellings are
+// stored in fixed-size chunks that never move once allocated, and a thread
+// only ever asks for ids that were handed to it after being interned.
+class SymbolTable {
+  static constexpr unsigned ChunkBits = 12;
+  static constexpr unsigned ChunkSize = 1u << ChunkBits;
+  static constexpr unsigned MaxChunks = 1u << 16;
+
+  std::mutex Lock;
+  llvm::StringMap<uint32_t> IDs;
+  std::unique_ptr<llvm::StringRef[]> Chunks[MaxChunks];
+  uint32_t Size = 0;
+
+public:
+  SymbolTable() { intern(""); }
+
+  Symbol intern(llvm::StringRef S) {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto [I, Inserted] = IDs.try_emplace(S, Size);
+    if (Inserted) {
+      assert(Size < ChunkSize * MaxChunks && "too many symbols");
+      auto &Chunk = Chunks[Size >> ChunkBits];
+      if (!Chunk)
+        Chunk = std::make_unique<llvm::StringRef[]>(ChunkSize);
+      // StringMap entries never move, so the key can be shared.
+      Chunk[Size & (ChunkSize - 1)] = I->first();
+      ++Size;
+    }
+    return Symbol(I->second);
+  }
+
+  llvm::StringRef str(Symbol S) const {
+    return Chunks[S.id() >> ChunkBits][S.id() & (ChunkSize - 1)];
+  }
+};
+
+extern SymbolTable Symbols;
+
+inline llvm::StringRef Symbol::str() const { return Symbols.str(*this); }
+
+inline std::ostream &operator<<(std::ostream &OS, Symbol S) {
+  auto Str = S.str();
+  return OS.write(Str.data(), Str.size());
+}
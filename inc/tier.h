@@ -0,0 +1,69 @@
+#pragma once
+
+#include "ast.h"
+#include "llvm.h"
+
+#include <algorithm>
+#include <llvm/ADT/StringSet.h>
+#include <memory>
+#include <mutex>
+
+struct EngineState;
+
+// Tiered compilation. Every definition is first compiled without
+// optimization into `name$t0.<version>`, with a call counter at its entry, and
+// published through the indirect stub `name`. When the counter reaches the
+// threshold, the baseline calls kale_tier_up and the definition is recompiled
+// at -O3 into `name$t1.<version>` on a background thread; the stub is then
+// repointed to the new code. The optimized tier may inline other definitions,
+// so redefining one of them sends its callers back to the baseline, and so
+// does memoizing their results.
+class TierManager {
+private:
+  struct Definition {
+    std::shared_ptr<FuncAST> ast;
+    uint64_t version = 0;
+  };
+
+  EngineState &Engine;
+  uint64_t Threshold;
+  std::mutex Lock;
+  llvm::StringMap<Definition> Definitions;
+  // The defs whose optimized code inlined each def.
+  llvm::StringMap<llvm::StringSet<>> Importers;
+  // The failures of background recompilations since the last takeErrors.
+  llvm::Error Errors = llvm::Error::success();
+  llvm::ThreadPool Pool;
+
+  // Compiles the baseline tier of a definition, points its stub at it, and
+  // does the same for the optimized callers that inlined the previous one.
+  llvm::Error addBaseline(std::shared_ptr<FuncAST> ast);
+
+public:
+  TierManager(EngineState &Engine, uint64_t Threshold)
+      : Engine(Engine), Threshold(std::max<uint64_t>(Threshold, 1)),
+        Pool(llvm::hardware_concurrency(1)) {}
+  // Waits for background recompilations. Their errors since the last
+  // takeErrors are dropped.
+  ~TierManager() {
+    Pool.wait();
+    llvm::consumeError(std::move(Errors));
+  }
+
+  // Compiles the baseline tier of a definition and points its stub at it,
+  // then recompiles the memoized definitions that call it. A redefinition
+  // that changes the parameter or result types is an error. The caller's
+  // TheEngine must be Engine.
+  llvm::Error addDefinition(std::shared_ptr<FuncAST> ast);
+
+  // Queues the optimized recompilation of a hot baseline. A failed
+  // recompilation leaves the baseline in place and is reported by takeErrors.
+  void promote(llvm::StringRef Name, uint64_t Version);
+
+  // Returns the failures of background recompilations so far.
+  llvm::Error takeErrors();
+};
+
+// Called by baselines that reached the threshold.
+extern "C" void kale_tier_up(TierManager *Tier, const char *Name,
+                             uint64_t Version);
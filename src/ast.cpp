@@ -0,0 +1,21 @@
+#include "ast.h"
+
+#include <llvm/Support/Format.h>
+#include <sys/resource.h>
+
+SymbolTable Symbols;
+ASTStats TheASTStats;
+
+void ASTStats::print(llvm::raw_ostream &OS) const {
+  double Seconds = ParseNanos * 1e-9;
+  struct rusage Usage;
+  getrusage(RUSAGE_SELF, &Usage);
+  OS << "AST nodes:      " << Nodes << "\n";
+  OS << "AST arena:      " << ArenaBytes << " bytes\n";
+  OS << "Parse time:     " << llvm::format("%.3f", Seconds) << " s\n";
+  if (Seconds > 0)
+    OS << "Parse rate:     " << llvm::format("%.0f", Nodes / Seconds)
+       << " nodes/s\n";
+  // ru_maxrss is in KiB on Linux.
+  OS << "Peak RSS:       " << Usage.ru_maxrss << " KiB\n";
+}
@@ -0,0 +1,309 @@
+#include <algorithm>
+#include <chrono>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/JSON.h>
+#include <tuple>
+
+#include "ast.h"
+#include "jit.h"
+#include "llvm.h"
+#include "parser.h"
+#include "pfor.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Microbenchmarks of the compiler phases: lexing, parsing, codegen, the IR
+// pipeline, materialization by the JIT, symbol lookup and calls into compiled
+// code. Every phase runs over every corpus once to warm up and then
+// --repetitions times, and the timings are written out as JSON so that runs
+// of different versions can be compared.
+//
+// Besides the synthetic corpora, any source files given on the command line
+// are measured too. They may hold one def per name; top-level expressions are
+// only lexed and parsed.
+
+static cl::OptionCategory BenchCategory("kale_bench options");
+
+static cl::list<std::string> CorpusFiles(cl::Positional,
+                                         cl::desc("[corpus files...]"),
+                                         cl::cat(BenchCategory));
+
+static cl::opt<std::string>
+    OutputFilename("o", cl::desc("Write the JSON report to this file"),
+                   cl::value_desc("filename"), cl::init("-"),
+                   cl::cat(BenchCategory));
+
+static cl::opt<unsigned>
+    Repetitions("repetitions", cl::desc("Timed runs of every phase"),
+                cl::init(10), cl::cat(BenchCategory));
+
+static cl::opt<unsigned>
+    Scale("scale", cl::desc("Size factor of the synthetic corpora"),
+          cl::init(1), cl::cat(BenchCategory));
+
+static cl::list<std::string>
+    Phases("phase",
+           cl::desc("Only time these phases: lex, parse, codegen, optimize, "
+                    "materialize, lookup, call"),
+           cl::value_desc("phase,..."), cl::CommaSeparated,
+           cl::cat(BenchCategory));
+
+static cl::opt<char>
+    OptLevel("O",
+             cl::desc("Optimization level: -O0, -O1, -O2 or -O3 "
+                      "(default: -O2)"),
+             cl::Prefix, cl::init('2'), cl::cat(BenchCategory));
+
+struct Corpus {
+  std::string Name;
+  std::string Source;
+  // The def timed by the call phase, its argument and the number of calls.
+  std::string Entry;
+  double Arg = 1;
+  uint64_t Calls = 0;
+};
+
+// Keeps the long loop from being optimized away.
+extern "C" double bench_sink(double X) { return X; }
+
+static std::vector<Corpus> syntheticCorpora() {
+  std::vector<Corpus> Corpora;
+  std::string S;
+  unsigned Depth = 200 * Scale;
+  S = "def deep(x) ";
+  for (unsigned I = 0; I < Depth; ++I)
+    S += I % 2 ? "(x * " : "(x + ";
+  S += "1";
+  S.append(Depth, ')');
+  Corpora.push_back({"deep-expr", S, "deep", 1, 100000});
+
+  unsigned Defs = 1000 * Scale;
+  S = "def f0(x) x + 1\n";
+  for (unsigned I = 1; I < Defs; ++I)
+    S += formatv("def f{0}(x) f{1}(x) * 0.5 + x\n", I, I - 1).str();
+  Corpora.push_back(
+      {"many-defs", S, formatv("f{0}", Defs - 1).str(), 1, 100000});
+
+  unsigned Terms = 10000 * Scale;
+  S = "def huge(x) 0";
+  for (unsigned I = 1; I < Terms; ++I)
+    S += formatv(" + x * {0}", I).str();
+  Corpora.push_back({"huge-func", S, "huge", 1, 100000});
+
+  S = "ext bench_sink(x)\n"
+      "def loop(n) for i = 0, i < n, i + 1 in bench_sink(i * i)\n";
+  Corpora.push_back({"long-loop", S, "loop", 1e6 * Scale, 1});
+  return Corpora;
+}
+
+static bool isEnabled(StringRef Phase) {
+  return Phases.empty() || is_contained(Phases, Phase);
+}
+
+// Times Run after one warm-up run and appends the statistics to Results.
+// Setup and Teardown are run around every run and are not timed.
+static void measure(json::Array &Results, const Corpus &C, StringRef Phase,
+                    uint64_t Items, function_ref<void()> Run,
+                    function_ref<void()> Setup = nullptr,
+                    function_ref<void()> Teardown = nullptr) {
+  if (!isEnabled(Phase))
+    return;
+  std::vector<double> Nanos;
+  for (unsigned R = 0; R <= Repetitions; ++R) {
+    if (Setup)
+      Setup();
+    auto Start = std::chrono::steady_clock::now();
+    Run();
+    std::chrono::duration<double, std::nano> Time =
+        std::chrono::steady_clock::now() - Start;
+    if (Teardown)
+      Teardown();
+    if (R)
+      Nanos.push_back(Time.count());
+  }
+  llvm::sort(Nanos);
+  double Mean = 0;
+  for (auto N : Nanos)
+    Mean += N / Nanos.size();
+  double Median = Nanos[Nanos.size() / 2];
+  Results.push_back(json::Object{
+      {"corpus", C.Name},
+      {"phase", Phase},
+      {"items", int64_t(Items)},
+      {"min_ns", Nanos.front()},
+      {"median_ns", Median},
+      {"mean_ns", Mean},
+      {"max_ns", Nanos.back()},
+      {"items_per_second", Median > 0 ? Items / (Median * 1e-9) : 0.0},
+  });
+}
+
+static void benchCorpus(const Corpus &C, json::Array &Results) {
+  Lexer L;
+  uint64_t Tokens = 0;
+  L.openBuffer(C.Source);
+  while (L.getNextToken() != tok_eof)
+    ++Tokens;
+  measure(Results, C, "lex", Tokens, [&] {
+    L.openBuffer(C.Source);
+    while (L.getNextToken() != tok_eof)
+      ;
+  });
+
+  std::vector<FuncAST> Defs;
+  std::vector<ProtoTypeAST> Exts;
+  uint64_t Items = 0;
+  auto Parse = [&] {
+    Defs.clear();
+    Exts.clear();
+    Items = 0;
+    Parser P;
+    P.openBuffer(C.Source);
+    P.getNextToken();
+    while (P.getToken() != tok_eof) {
+      switch (P.getToken()) {
+      case tok_ext:
+        if (auto Proto = P.parseExt())
+          Exts.push_back(std::move(*Proto));
+        else
+          P.getNextToken();
+        break;
+      case tok_def:
+        if (auto ast = P.parseFunc(); ast.body)
+          Defs.push_back(std::move(ast));
+        else
+          P.getNextToken();
+        break;
+      case ';':
+        P.consume(';');
+        continue;
+      default:
+        if (!P.parseTopLevelExpr().body)
+          P.getNextToken();
+      }
+      ++Items;
+    }
+  };
+  Parse();
+  measure(Results, C, "parse", Items, Parse);
+  for (auto &Proto : Exts)
+    addFunctionProto(Proto);
+  for (auto &ast : Defs)
+    addFunctionProto(ast.proto);
+
+  auto Codegen = [&] {
+    for (auto &ast : Defs)
+      ast.codegen(/*Optimize=*/false);
+  };
+  measure(Results, C, "codegen", Defs.size(), Codegen, InitializeModule);
+
+  measure(
+      Results, C, "optimize", Defs.size(), [] { OptimizeModule(); },
+      [&] {
+        InitializeModule();
+        Codegen();
+      });
+
+  ResourceTrackerSP RT;
+  auto Compile = [&] {
+    InitializeModule();
+    Codegen();
+    OptimizeModule();
+    RT = TheEngine->JIT->getMainJITDylib().createResourceTracker();
+  };
+  auto LookupAll = [&] {
+    for (auto &ast : Defs)
+      ExitOnErr(TheEngine->JIT->lookup(ast.proto.name.str()));
+  };
+  auto Remove = [&] { ExitOnErr(RT->remove()); };
+  measure(
+      Results, C, "materialize", Defs.size(),
+      [&] {
+        ExitOnErr(TheEngine->JIT->addModule(TakeModule(), RT));
+        LookupAll();
+      },
+      Compile, Remove);
+
+  // Leave the corpus materialized for the remaining phases.
+  Compile();
+  ExitOnErr(TheEngine->JIT->addModule(TakeModule(), RT));
+  LookupAll();
+  measure(Results, C, "lookup", Defs.size(), LookupAll);
+  if (!C.Entry.empty()) {
+    auto Sym = ExitOnErr(TheEngine->JIT->lookup(C.Entry));
+    auto F = Sym.getAddress().toPtr<double (*)(double)>();
+    volatile double Sink;
+    measure(Results, C, "call", C.Calls, [&] {
+      for (uint64_t I = 0; I < C.Calls; ++I)
+        Sink = F(C.Arg);
+    });
+    (void)Sink;
+  }
+  Remove();
+  InitializeModule();
+}
+
+int main(int argc, char **argv) {
+  cl::HideUnrelatedOptions(BenchCategory);
+  cl::ParseCommandLineOptions(argc, argv,
+                              "Kaleidoscope compiler microbenchmarks\n");
+  ExitOnErr.setBanner("kale_bench: ");
+  if (!Repetitions) {
+    errs() << "kale_bench: --repetitions must be at least 1\n";
+    return 1;
+  }
+
+  auto Corpora = syntheticCorpora();
+  for (auto &Path : CorpusFiles) {
+    auto Buf = MemoryBuffer::getFile(Path);
+    if (!Buf) {
+      errs() << "kale_bench: cannot open " << Path << ": "
+             << Buf.getError().message() << "\n";
+      return 1;
+    }
+    Corpora.push_back({sys::path::filename(Path).str(),
+                       (*Buf)->getBuffer().str(), "", 0, 0});
+  }
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  EngineState State;
+  EngineScope Scope(State);
+  JITOptions Opts;
+  auto Levels = getOptLevels(OptLevel);
+  if (!Levels) {
+    errs() << "kale_bench: invalid optimization level -O" << OptLevel << "\n";
+    return 1;
+  }
+  std::tie(State.OptLevel, Opts.OptLevel) = *Levels;
+  State.JIT = ExitOnErr(KaleidoscopeJIT::Create(Opts));
+  ExitOnErr(State.JIT->defineRuntimeSymbol(
+      "kale_pfor", ExecutorAddr::fromPtr(&kale_pfor)));
+  ExitOnErr(State.JIT->defineRuntimeSymbol(
+      "bench_sink", ExecutorAddr::fromPtr(&bench_sink)));
+  InitializeModuleAndManagers();
+
+  json::Array Results;
+  for (auto &C : Corpora)
+    benchCorpus(C, Results);
+
+  std::error_code EC;
+  ToolOutputFile Out(OutputFilename, EC, sys::fs::OF_Text);
+  if (EC)
+    ExitOnErr(createFileError(OutputFilename, EC));
+  json::Value Report = json::Object{
+      {"llvm_version", LLVM_VERSION_STRING},
+      {"host_cpu", sys::getHostCPUName()},
+      {"opt_level", std::string("O") + OptLevel.getValue()},
+      {"repetitions", int64_t(Repetitions)},
+      {"scale", int64_t(Scale)},
+      {"results", std::move(Results)},
+  };
+  Out.os() << formatv("{0:2}", Report) << "\n";
+  Out.keep();
+  return 0;
+}
@@ -0,0 +1,13 @@
+#include "buffer.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+extern "C" void kale_bounds_fail(int64_t Index, int64_t Size) {
+  std::fprintf(stderr,
+               "kale: index %" PRId64 " out of bounds of a buf of %" PRId64
+               " elements\n",
+               Index, Size);
+  std::abort();
+}
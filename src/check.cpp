@@ -0,0 +1,148 @@
+#include "check.h"
+#include "jit.h"
+
+#include <optional>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+namespace {
+class Checker {
+public:
+  explicit Checker(const ProtoTypeAST &Proto) : Proto(Proto) {
+    for (size_t I = 0; I < Proto.parameters.size(); ++I)
+      bind(Proto.parameters[I], Proto.types[I]);
+  }
+
+  Error check(const ExprAST *E);
+
+private:
+  const ProtoTypeAST &Proto;
+  // The type of every variable bound where the expression being checked is,
+  // by symbol id. Loop variables are numbers of some type.
+  std::vector<std::optional<NumType>> Vars;
+
+  std::optional<NumType> &lookup(Symbol Name) {
+    if (Name.id() >= Vars.size())
+      Vars.resize(Name.id() + 1);
+    return Vars[Name.id()];
+  }
+
+  // Binds Name to a value of type T and returns what it shadows.
+  std::optional<NumType> bind(Symbol Name, NumType T) {
+    return std::exchange(lookup(Name), T);
+  }
+
+  // Whether E names a buf, as the argument of len or of a buf parameter.
+  bool isBuffer(const ExprAST *E) {
+    auto V = dyn_cast<VarExprAST>(E);
+    return V && lookup(V->name) == NumType::Buf;
+  }
+
+  std::optional<ProtoTypeAST> getCalleeProto(Symbol Name) {
+    // A def may call itself before its prototype is registered.
+    if (Name == Proto.name)
+      return Proto;
+    return getFunctionProto(Name);
+  }
+
+  Error checkChildren(const ExprAST *E) {
+    Error Err = Error::success();
+    forEachChild(E, [&](const ExprAST *Sub) {
+      if (!Err)
+        Err = check(Sub);
+    });
+    return Err;
+  }
+
+  Error checkLoopBody(Symbol Name, ArrayRef<const ExprAST *> Scoped) {
+    auto Shadowed = bind(Name, NumType::F64);
+    Error Err = Error::success();
+    for (auto Sub : Scoped)
+      if (!Err)
+        Err = check(Sub);
+    lookup(Name) = Shadowed;
+    return Err;
+  }
+};
+} // namespace
+
+static Error checkError(const Twine &Message) {
+  return createStringError(inconvertibleErrorCode(), Message);
+}
+
+Error Checker::check(const ExprAST *E) {
+  switch (E->kind) {
+  case ExprAST::Var: {
+    // Arguments that are bufs are checked by their call.
+    auto Name = cast<VarExprAST>(E)->name;
+    auto T = lookup(Name);
+    if (!T)
+      return checkError("unknown variable '" + Name.str() + "'");
+    if (*T == NumType::Buf)
+      return checkError("the buf '" + Name.str() +
+                        "' can only be indexed, passed to len or passed as a "
+                        "buf argument");
+    return Error::success();
+  }
+  case ExprAST::Call: {
+    auto C = cast<CallExprAST>(E);
+    // len(b) of a buf b is built in, and shadows any def named len.
+    static Symbol Len = Symbols.intern("len");
+    if (C->callee == Len && C->arguments.size() == 1 &&
+        isBuffer(C->arguments[0]))
+      return Error::success();
+    auto Callee = getCalleeProto(C->callee);
+    if (!Callee && C->callee == Len)
+      return checkError("len takes one buf");
+    if (!Callee)
+      return checkError("unknown function '" + C->callee.str() + "'");
+    if (Callee->parameters.size() != C->arguments.size())
+      return checkError("'" + C->callee.str() + "' takes " +
+                        Twine(Callee->parameters.size()) + " arguments, not " +
+                        Twine(C->arguments.size()));
+    for (size_t I = 0; I < C->arguments.size(); ++I) {
+      auto Arg = C->arguments[I];
+      if (Callee->types[I] != NumType::Buf) {
+        if (auto Err = check(Arg))
+          return Err;
+      } else if (!isBuffer(Arg)) {
+        return checkError("argument " + Twine(I + 1) + " of '" +
+                          C->callee.str() + "' must be a buf");
+      }
+    }
+    return Error::success();
+  }
+  case ExprAST::Index: {
+    auto Name = cast<IndexExprAST>(E)->buffer;
+    auto T = lookup(Name);
+    if (!T)
+      return checkError("unknown variable '" + Name.str() + "'");
+    if (*T != NumType::Buf)
+      return checkError("'" + Name.str() + "' is indexed but is not a buf");
+    return checkChildren(E);
+  }
+  case ExprAST::For: {
+    // The loop variable is bound from the condition on, not in Init.
+    auto L = cast<ForExprAST>(E);
+    if (auto Err = check(L->Init))
+      return Err;
+    return checkLoopBody(L->name, {L->Cond, L->Body, L->Next});
+  }
+  case ExprAST::PFor: {
+    auto P = cast<PForExprAST>(E);
+    for (auto Sub : {P->Begin, P->End, P->Chunk})
+      if (Sub)
+        if (auto Err = check(Sub))
+          return Err;
+    return checkLoopBody(P->name, {P->Body});
+  }
+  default:
+    return checkChildren(E);
+  }
+}
+
+Error checkDefinition(const FuncAST &Def) {
+  return Checker(Def.proto).check(Def.body);
+}
@@ -1,112 +1,351 @@
 #include "ast.h"
+#include "buffer.h"
 #include "jit.h"
 #include "llvm.h"
+#include "map.h"
 
-#include <map>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 
 using namespace llvm;
 using namespace llvm::orc;
 
-std::unique_ptr<LLVMContext> TheContext;
-std::unique_ptr<Module> TheModule;
-std::unique_ptr<IRBuilder<>> Builder;
-std::map<std::string, Value *> NamedValues;
-std::unique_ptr<KaleidoscopeJIT> TheJIT;
-std::unique_ptr<FunctionPassManager> TheFPM;
-std::unique_ptr<LoopAnalysisManager> TheLAM;
-std::unique_ptr<FunctionAnalysisManager> TheFAM;
-std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
-std::unique_ptr<ModuleAnalysisManager> TheMAM;
-std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
-std::unique_ptr<StandardInstrumentations> TheSI;
-std::map<std::string, ProtoTypeAST> FunctionProtos;
+thread_local ThreadSafeContext TheTSC;
+thread_local LLVMContext *TheContext;
+thread_local std::unique_ptr<Module> TheModule;
+thread_local std::unique_ptr<IRBuilder<>> Builder;
+thread_local std::vector<Value *> NamedValues;
+thread_local EngineState *TheEngine;
+thread_local std::unique_ptr<TargetMachine> TheTM;
+thread_local std::unique_ptr<ModulePassManager> TheMPM;
+thread_local std::unique_ptr<LoopAnalysisManager> TheLAM;
+thread_local std::unique_ptr<FunctionAnalysisManager> TheFAM;
+thread_local std::unique_ptr<CGSCCAnalysisManager> TheCGAM;
+thread_local std::unique_ptr<ModuleAnalysisManager> TheMAM;
+thread_local std::unique_ptr<PassInstrumentationCallbacks> ThePIC;
+thread_local std::unique_ptr<StandardInstrumentations> TheSI;
 ExitOnError ExitOnErr;
 
-Function *getFunction(std::string name) {
-  if (auto F = TheModule->getFunction(name)) {
+// The engines TheTM and TheModule were created for.
+static thread_local uint64_t TheTMEngine;
+static thread_local uint64_t TheModuleEngine;
+
+// The functions of TheModule by symbol, so that calls resolve without hashing
+// the callee's name. Dropped with the module, and by OptimizeModule, which may
+// delete functions.
+static thread_local std::vector<Function *> ModuleFunctions;
+
+template <typename T> static T &lookupSymbol(std::vector<T> &Table, Symbol S) {
+  if (S.id() >= Table.size())
+    Table.resize(S.id() + 1);
+  return Table[S.id()];
+}
+
+void addFunctionProto(const ProtoTypeAST &Proto) {
+  std::unique_lock<std::shared_mutex> Lock(TheEngine->FunctionProtosMutex);
+  lookupSymbol(TheEngine->FunctionProtos, Proto.name) = Proto;
+}
+
+std::optional<ProtoTypeAST> getFunctionProto(Symbol Name) {
+  std::shared_lock<std::shared_mutex> Lock(TheEngine->FunctionProtosMutex);
+  auto &Protos = TheEngine->FunctionProtos;
+  if (Name.id() < Protos.size())
+    return Protos[Name.id()];
+  return std::nullopt;
+}
+
+static Function *getModuleFunction(Symbol name) {
+  auto &F = lookupSymbol(ModuleFunctions, name);
+  if (!F)
+    F = TheModule->getFunction(name.str());
+  return F;
+}
+
+Function *getFunction(Symbol name) {
+  if (auto F = getModuleFunction(name)) {
     return F;
   }
-  auto FI = FunctionProtos.find(name);
-  if (FI != FunctionProtos.end()) {
-    return FI->second.codegen();
+  if (auto Proto = getFunctionProto(name)) {
+    return Proto->codegen();
   }
   return nullptr;
 }
 
 void InitializeModuleAndManagers() {
-  // Open a new context and module.
-  TheContext = std::make_unique<LLVMContext>();
-  TheModule = std::make_unique<Module>("KaleidoscopeJIT", *TheContext);
-  TheModule->setDataLayout(TheJIT->getDataLayout());
+  // TargetMachines are not thread-safe, so every thread creates its own for
+  // each engine it compiles for. Without a JIT, the caller provides it.
+  if (TheEngine->JIT && (!TheTM || TheTMEngine != TheEngine->ID)) {
+    TheTM = TheEngine->JIT->createTargetMachine();
+    TheTMEngine = TheEngine->ID;
+  }
+
+  // Open a new context.
+  TheTSC = ThreadSafeContext(std::make_unique<LLVMContext>());
+  TheContext = TheTSC.getContext();
 
-  // Create a new builder for the module.
+  // Create a new builder for the context.
   Builder = std::make_unique<IRBuilder<>>(*TheContext);
 
   // Create new pass and analysis managers.
-  TheFPM = std::make_unique<FunctionPassManager>();
   TheLAM = std::make_unique<LoopAnalysisManager>();
   TheFAM = std::make_unique<FunctionAnalysisManager>();
   TheCGAM = std::make_unique<CGSCCAnalysisManager>();
   TheMAM = std::make_unique<ModuleAnalysisManager>();
   ThePIC = std::make_unique<PassInstrumentationCallbacks>();
-  TheSI = std::make_unique<StandardInstrumentations>(*TheContext,
-                                                     /*DebugLogging*/ true);
+  // Pass timings go to the time trace if this thread records one.
+  TheSI = std::make_unique<StandardInstrumentations>(
+      *TheContext, TheEngine->Verbose >= Verbosity::Passes);
   TheSI->registerCallbacks(*ThePIC, TheMAM.get());
 
-  // Add transform passes.
-  // Do simple "peephole" optimizations and bit-twiddling optzns.
-  TheFPM->addPass(InstCombinePass());
-  // Reassociate expressions.
-  TheFPM->addPass(ReassociatePass());
-  // Eliminate Common SubExpressions.
-  TheFPM->addPass(GVNPass());
-  // Simplify the control flow graph (deleting unreachable blocks, etc).
-  TheFPM->addPass(SimplifyCFGPass());
-
-  // Register analysis passes used in these transform passes.
-  PassBuilder PB;
+  // Build the standard pipeline for the selected level. Handing the
+  // TargetMachine to the PassBuilder lets the cost models and vectorizers see
+  // the real CPU features.
+  PipelineTuningOptions PTO;
+  PTO.LoopVectorization = TheEngine->OptLevel.getSpeedupLevel() > 1;
+  PTO.SLPVectorization = TheEngine->OptLevel.getSpeedupLevel() > 1;
+  PassBuilder PB(TheTM.get(), PTO, std::nullopt, ThePIC.get());
   PB.registerModuleAnalyses(*TheMAM);
+  PB.registerCGSCCAnalyses(*TheCGAM);
   PB.registerFunctionAnalyses(*TheFAM);
+  PB.registerLoopAnalyses(*TheLAM);
   PB.crossRegisterProxies(*TheLAM, *TheFAM, *TheCGAM, *TheMAM);
+  TheMPM = std::make_unique<ModulePassManager>(
+      TheEngine->OptLevel == OptimizationLevel::O0
+          ? PB.buildO0DefaultPipeline(TheEngine->OptLevel)
+          : PB.buildPerModuleDefaultPipeline(TheEngine->OptLevel));
+
+  TheModuleEngine = TheEngine->ID;
+  InitializeModule();
 }
 
-llvm::Value *NumExprAST::codegen() {
-  return llvm::ConstantFP::get(*TheContext, llvm::APFloat(val));
+void EnsureModule() {
+  if (!TheModule || TheModuleEngine != TheEngine->ID)
+    InitializeModuleAndManagers();
 }
 
-llvm::Value *VarExprAST::codegen() { return NamedValues[name]; }
+void InitializeModule() {
+  // Drop analysis results that still refer to the previous module.
+  TheLAM->clear();
+  TheFAM->clear();
+  TheCGAM->clear();
+  TheMAM->clear();
 
-llvm::Value *BinExprAST::codegen() {
-  auto L = lhs->codegen();
-  auto R = rhs->codegen();
+  ModuleFunctions.clear();
+  TheModule = std::make_unique<Module>("KaleidoscopeJIT", *TheContext);
+  TheModule->setDataLayout(TheTM->createDataLayout());
+  TheModule->setTargetTriple(TheTM->getTargetTriple().str());
+}
+
+ThreadSafeModule TakeModule() {
+  return ThreadSafeModule(std::move(TheModule), TheTSC);
+}
+
+void OptimizeModule() {
+  if (TheEngine->OptLevel != OptimizationLevel::O0)
+    importCallees();
+  ModuleFunctions.clear();
+  TheMAM->invalidate(*TheModule, PreservedAnalyses::none());
+  TheMPM->run(*TheModule, *TheMAM);
+}
+
+void OptimizeModule(Module &M, OptimizationLevel Level) {
+  LoopAnalysisManager LAM;
+  FunctionAnalysisManager FAM;
+  CGSCCAnalysisManager CGAM;
+  ModuleAnalysisManager MAM;
+  PassInstrumentationCallbacks PIC;
+  StandardInstrumentations SI(M.getContext(),
+                              TheEngine->Verbose >= Verbosity::Passes);
+  SI.registerCallbacks(PIC, &MAM);
+  PipelineTuningOptions PTO;
+  PTO.LoopVectorization = Level.getSpeedupLevel() > 1;
+  PTO.SLPVectorization = Level.getSpeedupLevel() > 1;
+  PassBuilder PB(TheTM.get(), PTO, std::nullopt, &PIC);
+  PB.registerModuleAnalyses(MAM);
+  PB.registerCGSCCAnalyses(CGAM);
+  PB.registerFunctionAnalyses(FAM);
+  PB.registerLoopAnalyses(LAM);
+  PB.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+  if (Level == OptimizationLevel::O0)
+    PB.buildO0DefaultPipeline(Level).run(M, MAM);
+  else
+    PB.buildPerModuleDefaultPipeline(Level).run(M, MAM);
+}
+
+std::optional<std::pair<OptimizationLevel, CodeGenOptLevel>>
+getOptLevels(char Level) {
+  switch (Level) {
+  case '0':
+    return std::pair(OptimizationLevel::O0, CodeGenOptLevel::None);
+  case '1':
+    return std::pair(OptimizationLevel::O1, CodeGenOptLevel::Less);
+  case '2':
+    return std::pair(OptimizationLevel::O2, CodeGenOptLevel::Default);
+  case '3':
+    return std::pair(OptimizationLevel::O3, CodeGenOptLevel::Aggressive);
+  default:
+    return std::nullopt;
+  }
+}
+
+static Type *getType(NumType T) {
+  switch (T) {
+  case NumType::F64:
+    return Type::getDoubleTy(*TheContext);
+  case NumType::F32:
+    return Type::getFloatTy(*TheContext);
+  case NumType::I64:
+    return Type::getInt64Ty(*TheContext);
+  case NumType::Buf:
+    return PointerType::getUnqual(*TheContext);
+  }
+  return nullptr;
+}
+
+// Converts V to T by value. Floating point converts to i64 rounding toward
+// zero, so a literal 2.5 is 2 where an i64 is expected.
+static Value *convert(Value *V, Type *T) {
+  if (V->getType() == T)
+    return V;
+  if (V->getType()->isIntegerTy())
+    return Builder->CreateSIToFP(V, T);
+  if (T->isIntegerTy())
+    return Builder->CreateFPToSI(V, T);
+  return Builder->CreateFPCast(V, T);
+}
+
+// The type in which two operands are combined: theirs if they agree, f64 if
+// not. A literal takes the type of the other operand.
+static Type *getCommonType(const ExprAST *LE, Value *L, const ExprAST *RE,
+                           Value *R) {
+  if (isa<NumExprAST>(LE))
+    return R->getType();
+  if (isa<NumExprAST>(RE))
+    return L->getType();
+  return L->getType() == R->getType() ? L->getType()
+                                      : Type::getDoubleTy(*TheContext);
+}
+
+// Tests a condition, which is true when it is not zero.
+static Value *isTrue(Value *V) {
+  if (V->getType()->isIntegerTy())
+    return Builder->CreateICmpNE(V, ConstantInt::get(V->getType(), 0));
+  return Builder->CreateFCmpONE(V, ConstantFP::get(V->getType(), 0.0));
+}
+
+static Value *emitBinary(char op, const ExprAST *LE, Value *L,
+                         const ExprAST *RE, Value *R) {
+  auto T = getCommonType(LE, L, RE, R);
+  L = convert(L, T);
+  R = convert(R, T);
+  bool Int = T->isIntegerTy();
   switch (op) {
   case '<':
+    if (Int)
+      return Builder->CreateZExt(Builder->CreateICmpSLT(L, R), T);
     L = Builder->CreateFCmpULT(L, R);
-    return Builder->CreateUIToFP(L, llvm::Type::getDoubleTy(*TheContext));
+    return Builder->CreateUIToFP(L, T);
   case '+':
-    return Builder->CreateFAdd(L, R);
+    return Int ? Builder->CreateAdd(L, R) : Builder->CreateFAdd(L, R);
   case '-':
-    return Builder->CreateFSub(L, R);
+    return Int ? Builder->CreateSub(L, R) : Builder->CreateFSub(L, R);
   case '*':
-    return Builder->CreateFMul(L, R);
+    return Int ? Builder->CreateMul(L, R) : Builder->CreateFMul(L, R);
   default:
     return nullptr;
   }
 }
 
+llvm::Value *ExprAST::codegen() {
+  switch (kind) {
+  case Num:
+    return cast<NumExprAST>(this)->codegen();
+  case Var:
+    return cast<VarExprAST>(this)->codegen();
+  case Bin:
+    return cast<BinExprAST>(this)->codegen();
+  case Call:
+    return cast<CallExprAST>(this)->codegen();
+  case If:
+    return cast<IfExprAST>(this)->codegen();
+  case For:
+    return cast<ForExprAST>(this)->codegen();
+  case PFor:
+    return cast<PForExprAST>(this)->codegen();
+  case Index:
+    return cast<IndexExprAST>(this)->codegen();
+  }
+  return nullptr;
+}
+
+llvm::Value *NumExprAST::codegen() {
+  return llvm::ConstantFP::get(*TheContext, llvm::APFloat(val));
+}
+
+llvm::Value *VarExprAST::codegen() {
+  return lookupSymbol(NamedValues, name);
+}
+
+llvm::Value *BinExprAST::codegen() {
+  auto L = lhs->codegen();
+  auto R = rhs->codegen();
+  return emitBinary(op, lhs, L, rhs, R);
+}
+
+// Returns the descriptor bound to the buf parameter Name, or null.
+static Value *getBuffer(Symbol Name) {
+  auto V = lookupSymbol(NamedValues, Name);
+  return V && V->getType()->isPointerTy() ? V : nullptr;
+}
+
+// Returns the descriptor of b if C is `len(b)` for a buf b, or null.
+static Value *getLenBuffer(const CallExprAST *C) {
+  static Symbol Len = Symbols.intern("len");
+  if (C->callee != Len || C->arguments.size() != 1)
+    return nullptr;
+  auto V = dyn_cast<VarExprAST>(C->arguments[0]);
+  return V ? getBuffer(V->name) : nullptr;
+}
+
+// A TBAA tag of its own for each kind of memory that buf accesses touch, so
+// that storing an element does not force the descriptors to be reloaded.
+static MDNode *getTBAATag(StringRef Type) {
+  MDBuilder MDB(*TheContext);
+  auto Node = MDB.createTBAAScalarTypeNode(Type, MDB.createTBAARoot("kale"));
+  return MDB.createTBAAStructTagNode(Node, Node, 0);
+}
+
+// Loads the element pointer and the length from the descriptor Desc.
+static std::pair<Value *, Value *> loadBuffer(Value *Desc) {
+  auto &Ctx = *TheContext;
+  auto Int64Ty = Type::getInt64Ty(Ctx);
+  auto DescTy = StructType::get(Ctx, {PointerType::getUnqual(Ctx), Int64Ty});
+  auto Data =
+      Builder->CreateLoad(PointerType::getUnqual(Ctx),
+                          Builder->CreateStructGEP(DescTy, Desc, 0), "data");
+  Data->setMetadata(LLVMContext::MD_tbaa, getTBAATag("buf data"));
+  auto Size = Builder->CreateLoad(
+      Int64Ty, Builder->CreateStructGEP(DescTy, Desc, 1), "size");
+  Size->setMetadata(LLVMContext::MD_tbaa, getTBAATag("buf size"));
+  return {Data, Size};
+}
+
 llvm::Value *CallExprAST::codegen() {
+  // len(b) is the length of the buf b, unless b is not a buf.
+  if (auto Desc = getLenBuffer(this))
+    return loadBuffer(Desc).second;
   auto Callee = getFunction(callee);
   std::vector<llvm::Value *> Args;
-  for (auto &arg : arguments) {
-    Args.push_back(arg->codegen());
+  for (auto arg : arguments) {
+    Args.push_back(convert(
+        arg->codegen(), Callee->getFunctionType()->getParamType(Args.size())));
   }
   return Builder->CreateCall(Callee, Args);
 }
 
 llvm::Value *IfExprAST::codegen() {
-  auto CondV = Cond->codegen();
-  CondV =
-      Builder->CreateFCmpONE(CondV, ConstantFP::get(*TheContext, APFloat(0.0)));
+  auto CondV = isTrue(Cond->codegen());
   auto TheFunction = Builder->GetInsertBlock()->getParent();
   auto ThenBB = BasicBlock::Create(*TheContext);
   auto ElseBB = BasicBlock::Create(*TheContext);
@@ -116,25 +355,138 @@ llvm::Value *IfExprAST::codegen() {
   TheFunction->insert(TheFunction->end(), ThenBB);
   Builder->SetInsertPoint(ThenBB);
   auto ThenV = Then->codegen();
-  Builder->CreateBr(MergeBB);
   ThenBB = Builder->GetInsertBlock();
   // Else
   TheFunction->insert(TheFunction->end(), ElseBB);
   Builder->SetInsertPoint(ElseBB);
   auto ElseV = Else->codegen();
-  Builder->CreateBr(MergeBB);
   ElseBB = Builder->GetInsertBlock();
+  // Both branches end with their value in the common type.
+  auto T = getCommonType(Then, ThenV, Else, ElseV);
+  Builder->SetInsertPoint(ThenBB);
+  ThenV = convert(ThenV, T);
+  Builder->CreateBr(MergeBB);
+  Builder->SetInsertPoint(ElseBB);
+  ElseV = convert(ElseV, T);
+  Builder->CreateBr(MergeBB);
   // Merge
   TheFunction->insert(TheFunction->end(), MergeBB);
   Builder->SetInsertPoint(MergeBB);
-  auto phiNode = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2);
+  auto phiNode = Builder->CreatePHI(T, 2);
   phiNode->addIncoming(ThenV, ThenBB);
   phiNode->addIncoming(ElseV, ElseBB);
   return phiNode;
 }
 
-llvm::Value *ForExprAST::codegen() {
-  auto InitV = Init->codegen();
+// The (loop variable, buf) pairs for which `buf[variable]` needs no check in
+// the loop body being emitted.
+static thread_local SmallVector<std::pair<Symbol, Symbol>, 4> InBounds;
+
+// Branches to a cold failure path unless 0 <= Index < Size; as unsigned, a
+// negative index is above any size.
+static void emitBoundsCheck(Value *Index, Value *Size) {
+  auto &Ctx = *TheContext;
+  auto TheFunction = Builder->GetInsertBlock()->getParent();
+  auto OkBB = BasicBlock::Create(Ctx, "inbounds", TheFunction);
+  auto FailBB = BasicBlock::Create(Ctx, "outofbounds", TheFunction);
+  Builder->CreateCondBr(Builder->CreateICmpULT(Index, Size), OkBB, FailBB,
+                        MDBuilder(Ctx).createBranchWeights(1 << 20, 1));
+  Builder->SetInsertPoint(FailBB);
+  if (TheEngine->JIT) {
+    auto Int64Ty = Type::getInt64Ty(Ctx);
+    auto Fail = TheModule->getOrInsertFunction(
+        "kale_bounds_fail", Type::getVoidTy(Ctx), Int64Ty, Int64Ty);
+    auto Call = Builder->CreateCall(Fail, {Index, Size});
+    Call->setDoesNotReturn();
+    Call->addFnAttr(Attribute::Cold);
+  } else {
+    // Objects from kalec are linked without the runtime.
+    Builder->CreateIntrinsic(Intrinsic::trap, {}, {});
+  }
+  Builder->CreateUnreachable();
+  Builder->SetInsertPoint(OkBB);
+}
+
+llvm::Value *IndexExprAST::codegen() {
+  auto DoubleTy = Type::getDoubleTy(*TheContext);
+  // checkDefinition has made sure that buffer is a buf.
+  auto Desc = getBuffer(buffer);
+  auto IndexV = convert(index->codegen(), Type::getInt64Ty(*TheContext));
+  auto ValueV = value ? convert(value->codegen(), DoubleTy) : nullptr;
+  auto [Data, Size] = loadBuffer(Desc);
+  auto Var = dyn_cast<VarExprAST>(index);
+  if (!Var || !is_contained(InBounds, std::make_pair(Var->name, buffer)))
+    emitBoundsCheck(IndexV, Size);
+  auto Addr = Builder->CreateInBoundsGEP(DoubleTy, Data, IndexV);
+  Instruction *Access;
+  if (ValueV)
+    Access = Builder->CreateStore(ValueV, Addr);
+  else
+    Access = Builder->CreateLoad(DoubleTy, Addr);
+  Access->setMetadata(LLVMContext::MD_tbaa, getTBAATag("buf element"));
+  return ValueV ? ValueV : Access;
+}
+
+// Whether E has the same value in every iteration of a loop over Var: it
+// reads neither Var nor elements, and calls nothing but len.
+static bool isLoopInvariant(const ExprAST *E, Symbol Var) {
+  if (auto V = dyn_cast<VarExprAST>(E))
+    return V->name != Var;
+  if (auto C = dyn_cast<CallExprAST>(E))
+    return getLenBuffer(C) && isLoopInvariant(C->arguments[0], Var);
+  if (isa<IndexExprAST>(E) || isa<ForExprAST>(E) || isa<PForExprAST>(E))
+    return false;
+  bool Invariant = true;
+  forEachChild(E, [&](const ExprAST *Sub) {
+    Invariant &= isLoopInvariant(Sub, Var);
+  });
+  return Invariant;
+}
+
+// Returns Limit if L is `for i = ..., i < Limit, i + Step` with an invariant
+// Limit and a positive literal Step, so that i only grows while it is below
+// Limit. Returns null otherwise.
+static ExprAST *getCountedLimit(const ForExprAST &L) {
+  auto isVar = [&](const ExprAST *E) {
+    auto V = dyn_cast<VarExprAST>(E);
+    return V && V->name == L.name;
+  };
+  auto C = dyn_cast<BinExprAST>(L.Cond);
+  if (!C || C->op != '<' || !isVar(C->lhs) ||
+      !isLoopInvariant(C->rhs, L.name))
+    return nullptr;
+  auto N = dyn_cast<BinExprAST>(L.Next);
+  if (!N || N->op != '+')
+    return nullptr;
+  auto Step = dyn_cast<NumExprAST>(isVar(N->lhs) ? N->rhs : N->lhs);
+  if (!Step || !(isVar(N->lhs) || isVar(N->rhs)) || !(Step->val > 0))
+    return nullptr;
+  return C->rhs;
+}
+
+// Adds the bufs that E indexes with exactly Var. Fails if E has a loop of
+// its own; only innermost loops are versioned, so that nesting does not
+// multiply the copies of a body.
+static bool collectIndexed(const ExprAST *E, Symbol Var,
+                           SmallVectorImpl<Symbol> &Buffers) {
+  if (isa<ForExprAST>(E) || isa<PForExprAST>(E))
+    return false;
+  if (auto I = dyn_cast<IndexExprAST>(E)) {
+    auto V = dyn_cast<VarExprAST>(I->index);
+    if (V && V->name == Var && getBuffer(I->buffer) &&
+        !is_contained(Buffers, I->buffer))
+      Buffers.push_back(I->buffer);
+  }
+  bool Innermost = true;
+  forEachChild(E, [&](const ExprAST *Sub) {
+    Innermost &= collectIndexed(Sub, Var, Buffers);
+  });
+  return Innermost;
+}
+
+// Emits the loop from the current block and leaves the builder after it.
+static void emitLoop(ForExprAST &L, Value *InitV) {
+  auto name = L.name;
   auto TheFunction = Builder->GetInsertBlock()->getParent();
   auto PreheaderBB = Builder->GetInsertBlock();
   auto LoopBB = BasicBlock::Create(*TheContext);
@@ -144,51 +496,395 @@ llvm::Value *ForExprAST::codegen() {
   // Loop
   TheFunction->insert(TheFunction->end(), LoopBB);
   Builder->SetInsertPoint(LoopBB);
-  auto phiNode = Builder->CreatePHI(Type::getDoubleTy(*TheContext), 2);
+  auto phiNode = Builder->CreatePHI(InitV->getType(), 2);
   phiNode->addIncoming(InitV, PreheaderBB);
-  NamedValues[name] = phiNode;
-  auto CondV = Cond->codegen();
-  CondV =
-      Builder->CreateFCmpONE(CondV, ConstantFP::get(*TheContext, APFloat(0.0)));
-  Builder->CreateCondBr(CondV, ExecBB, AfterBB);
+  // The loop variable shadows any parameter of the same name until the loop
+  // ends.
+  auto Shadowed = lookupSymbol(NamedValues, name);
+  lookupSymbol(NamedValues, name) = phiNode;
+  Builder->CreateCondBr(isTrue(L.Cond->codegen()), ExecBB, AfterBB);
   // Exec
   TheFunction->insert(TheFunction->end(), ExecBB);
   Builder->SetInsertPoint(ExecBB);
-  Body->codegen();
-  auto NextV = Next->codegen();
+  L.Body->codegen();
+  auto NextV = convert(L.Next->codegen(), phiNode->getType());
+  ExecBB = Builder->GetInsertBlock();
   phiNode->addIncoming(NextV, ExecBB);
   Builder->CreateBr(LoopBB);
   // After
   TheFunction->insert(TheFunction->end(), AfterBB);
   Builder->SetInsertPoint(AfterBB);
-  return Constant::getNullValue(Type::getDoubleTy(*TheContext));
+  lookupSymbol(NamedValues, name) = Shadowed;
+}
+
+// A counted innermost loop that indexes bufs with its variable is versioned:
+// when the variable starts at 0 or above and its limit is within every one
+// of those bufs, a copy of the loop without their checks runs instead.
+llvm::Value *ForExprAST::codegen() {
+  auto InitV = Init->codegen();
+  auto Zero = Constant::getNullValue(Type::getDoubleTy(*TheContext));
+  SmallVector<Symbol, 4> Buffers;
+  auto Limit = getCountedLimit(*this);
+  if (!Limit || !collectIndexed(Body, name, Buffers) || Buffers.empty()) {
+    emitLoop(*this, InitV);
+    return Zero;
+  }
+  // The limit reads no element and calls nothing but len, so evaluating it
+  // once more is not observable.
+  auto LimitV = Limit->codegen();
+  auto T = getCommonType(cast<BinExprAST>(Cond)->lhs, InitV, Limit, LimitV);
+  bool Int = T->isIntegerTy();
+  auto InitTy = InitV->getType();
+  auto InRange =
+      InitTy->isIntegerTy()
+          ? Builder->CreateICmpSGE(InitV, ConstantInt::get(InitTy, 0))
+          : Builder->CreateFCmpOGE(InitV, ConstantFP::get(InitTy, 0.0));
+  for (auto B : Buffers) {
+    auto L = convert(LimitV, T);
+    auto Size = convert(loadBuffer(getBuffer(B)).second, T);
+    auto Within = Int ? Builder->CreateICmpSLE(L, Size)
+                      : Builder->CreateFCmpOLE(L, Size);
+    InRange = Builder->CreateAnd(InRange, Within);
+  }
+  auto TheFunction = Builder->GetInsertBlock()->getParent();
+  auto UncheckedBB = BasicBlock::Create(*TheContext, "unchecked", TheFunction);
+  auto CheckedBB = BasicBlock::Create(*TheContext, "checked", TheFunction);
+  auto MergeBB = BasicBlock::Create(*TheContext, "loopend");
+  Builder->CreateCondBr(InRange, UncheckedBB, CheckedBB);
+  Builder->SetInsertPoint(UncheckedBB);
+  for (auto B : Buffers)
+    InBounds.push_back({name, B});
+  emitLoop(*this, InitV);
+  InBounds.resize(InBounds.size() - Buffers.size());
+  Builder->CreateBr(MergeBB);
+  Builder->SetInsertPoint(CheckedBB);
+  emitLoop(*this, InitV);
+  Builder->CreateBr(MergeBB);
+  TheFunction->insert(TheFunction->end(), MergeBB);
+  Builder->SetInsertPoint(MergeBB);
+  return Zero;
+}
+
+// Adds the variables read by E that are bound where E is compiled.
+static void collectCaptures(const ExprAST *E,
+                            SmallVectorImpl<Symbol> &Captures) {
+  if (auto V = dyn_cast<VarExprAST>(E)) {
+    if (lookupSymbol(NamedValues, V->name) && !is_contained(Captures, V->name))
+      Captures.push_back(V->name);
+    return;
+  }
+  forEachChild(E, [&](const ExprAST *Sub) { collectCaptures(Sub, Captures); });
+}
+
+// The body is outlined into an internal chunk function
+//
+//   double chunk(ptr Env, i64 Begin, i64 End)
+//
+// that reloads the captured variables from Env, runs the iterations
+// [Begin, End) and returns their reduction. The loop itself is a call to the
+// kale_pfor runtime, with Env on the caller's stack.
+llvm::Value *PForExprAST::codegen() {
+  auto &Ctx = *TheContext;
+  auto DoubleTy = Type::getDoubleTy(Ctx);
+  auto Int64Ty = Type::getInt64Ty(Ctx);
+  auto PtrTy = PointerType::getUnqual(Ctx);
+  auto BeginV = convert(Begin->codegen(), Int64Ty);
+  auto EndV = convert(End->codegen(), Int64Ty);
+  auto ChunkV =
+      Chunk ? convert(Chunk->codegen(), Int64Ty) : Builder->getInt64(0);
+
+  SmallVector<Symbol, 8> Captures;
+  auto Shadowed = lookupSymbol(NamedValues, name);
+  lookupSymbol(NamedValues, name) = nullptr;
+  collectCaptures(Body, Captures);
+  SmallVector<Value *, 8> Values;
+  for (auto Var : Captures)
+    Values.push_back(lookupSymbol(NamedValues, Var));
+
+  auto TheFunction = Builder->GetInsertBlock()->getParent();
+  Value *Env = ConstantPointerNull::get(PtrTy);
+  if (!Captures.empty()) {
+    auto &Entry = TheFunction->getEntryBlock();
+    IRBuilder<> EntryBuilder(&Entry, Entry.begin());
+    // One 8-byte slot per variable, whatever its type.
+    auto EnvTy = ArrayType::get(DoubleTy, Captures.size());
+    Env = EntryBuilder.CreateAlloca(EnvTy, nullptr, "env");
+    for (unsigned I = 0; I < Values.size(); ++I)
+      Builder->CreateStore(
+          Values[I], Builder->CreateConstInBoundsGEP2_32(EnvTy, Env, 0, I));
+  }
+
+  auto ChunkFn = Function::Create(
+      FunctionType::get(DoubleTy, {PtrTy, Int64Ty, Int64Ty}, false),
+      Function::InternalLinkage, TheFunction->getName() + ".pfor",
+      TheModule.get());
+  {
+    IRBuilderBase::InsertPointGuard Guard(*Builder);
+    auto EntryBB = BasicBlock::Create(Ctx, "entry", ChunkFn);
+    auto LoopBB = BasicBlock::Create(Ctx, "loop", ChunkFn);
+    auto ExitBB = BasicBlock::Create(Ctx, "exit", ChunkFn);
+    auto ChunkBegin = ChunkFn->getArg(1);
+    auto ChunkEnd = ChunkFn->getArg(2);
+    Builder->SetInsertPoint(EntryBB);
+    for (unsigned I = 0; I < Captures.size(); ++I)
+      lookupSymbol(NamedValues, Captures[I]) = Builder->CreateLoad(
+          Values[I]->getType(),
+          Builder->CreateConstInBoundsGEP1_64(DoubleTy, ChunkFn->getArg(0), I),
+          Captures[I].str());
+    Builder->CreateCondBr(Builder->CreateICmpSLT(ChunkBegin, ChunkEnd), LoopBB,
+                          ExitBB);
+    // Loop
+    Builder->SetInsertPoint(LoopBB);
+    auto Identity = ConstantFP::get(DoubleTy, Reduce == '*' ? 1.0 : 0.0);
+    auto Index = Builder->CreatePHI(Int64Ty, 2);
+    Index->addIncoming(ChunkBegin, EntryBB);
+    auto Acc = Builder->CreatePHI(DoubleTy, 2);
+    Acc->addIncoming(Identity, EntryBB);
+    lookupSymbol(NamedValues, name) =
+        Builder->CreateSIToFP(Index, DoubleTy, name.str());
+    auto BodyV = convert(Body->codegen(), DoubleTy);
+    Value *NextAcc = Acc;
+    if (Reduce == '+')
+      NextAcc = Builder->CreateFAdd(Acc, BodyV);
+    else if (Reduce == '*')
+      NextAcc = Builder->CreateFMul(Acc, BodyV);
+    auto Next = Builder->CreateAdd(Index, Builder->getInt64(1), "", false,
+                                   /*HasNSW=*/true);
+    auto LatchBB = Builder->GetInsertBlock();
+    Index->addIncoming(Next, LatchBB);
+    Acc->addIncoming(NextAcc, LatchBB);
+    Builder->CreateCondBr(Builder->CreateICmpSLT(Next, ChunkEnd), LoopBB,
+                          ExitBB);
+    // Exit
+    Builder->SetInsertPoint(ExitBB);
+    auto Result = Builder->CreatePHI(DoubleTy, 2);
+    Result->addIncoming(Identity, EntryBB);
+    Result->addIncoming(NextAcc, LatchBB);
+    Builder->CreateRet(Result);
+    verifyFunction(*ChunkFn);
+  }
+  for (unsigned I = 0; I < Captures.size(); ++I)
+    lookupSymbol(NamedValues, Captures[I]) = Values[I];
+  lookupSymbol(NamedValues, name) = Shadowed;
+
+  auto Runtime = TheModule->getOrInsertFunction(
+      "kale_pfor", DoubleTy, PtrTy, PtrTy, Int64Ty, Int64Ty, Int64Ty,
+      Type::getInt32Ty(Ctx));
+  return Builder->CreateCall(Runtime, {ChunkFn, Env, BeginV, EndV, ChunkV,
+                                       Builder->getInt32(Reduce)});
 }
 
 llvm::Function *ProtoTypeAST::codegen() {
-  std::vector<llvm::Type *> doubles(parameters.size(),
-                                    llvm::Type::getDoubleTy(*TheContext));
-  auto type = llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext),
-                                      doubles, false);
+  std::vector<llvm::Type *> params;
+  for (auto T : types)
+    params.push_back(getType(T));
+  auto type = llvm::FunctionType::get(getType(result), params, false);
   auto func = llvm::Function::Create(type, llvm::Function::ExternalLinkage,
-                                     name, TheModule.get());
+                                     name.str(), TheModule.get());
   int i = 0;
   for (auto &arg : func->args()) {
-    arg.setName(parameters[i++]);
+    // The host passes a live descriptor, so its fields may be loaded
+    // speculatively, e.g. ahead of a loop that might not run.
+    if (types[i] == NumType::Buf) {
+      arg.addAttr(Attribute::getWithDereferenceableBytes(func->getContext(),
+                                                         sizeof(KaleBuffer)));
+      arg.addAttr(Attribute::getWithAlignment(func->getContext(),
+                                              Align(alignof(KaleBuffer))));
+    }
+    arg.setName(parameters[i++].str());
   }
+  lookupSymbol(ModuleFunctions, name) = func;
   return func;
 }
 
-llvm::Function *FuncAST::codegen() {
-  auto func = proto.codegen();
+namespace {
+// How the body of the def Name is emitted in tail position. Calls of the def
+// itself with all its arguments become jumps back to Header, whose phis hold
+// the parameters. With an accumulating operator Op, `x Op Name(...)` also
+// becomes a jump, after folding x into the Acc phi, and every return folds
+// Acc into its value. This reassociates the sums or products, so it is only
+// done where that cannot change the result, with integers, which wrap, or
+// where fast-math flags allow it.
+struct TailState {
+  TailState(Symbol Name, Function *F)
+      : Name(Name), F(F), Arity(F->arg_size()) {}
+  Symbol Name;
+  Function *F;
+  size_t Arity;
+  BasicBlock *Header = nullptr;
+  SmallVector<PHINode *, 6> Params;
+  char Op = 0;
+  PHINode *Acc = nullptr;
+};
+} // namespace
+
+static bool isSelfCall(const ExprAST *E, const TailState &TS) {
+  auto Call = dyn_cast<CallExprAST>(E);
+  return Call && Call->callee == TS.Name && Call->arguments.size() == TS.Arity;
+}
+
+// Whether E may have effects or observe those of a call: it calls, runs a
+// pfor or reads or writes elements, which the call may write or read.
+static bool hasCalls(const ExprAST *E) {
+  if (isa<CallExprAST>(E) || isa<PForExprAST>(E) || isa<IndexExprAST>(E))
+    return true;
+  bool Found = false;
+  forEachChild(E, [&](const ExprAST *Sub) { Found |= hasCalls(Sub); });
+  return Found;
+}
+
+// Splits `x + f(...)` or `x * f(...)` into x and the call of the def. The
+// call may come first when x neither calls nor touches elements, so that the
+// order of evaluation cannot be observed.
+static std::pair<ExprAST *, CallExprAST *>
+matchAccumulation(const ExprAST *E, const TailState &TS) {
+  auto B = dyn_cast<BinExprAST>(E);
+  if (!B || (B->op != '+' && B->op != '*'))
+    return {};
+  if (isSelfCall(B->rhs, TS))
+    return {B->lhs, cast<CallExprAST>(B->rhs)};
+  if (isSelfCall(B->lhs, TS) && !hasCalls(B->rhs))
+    return {B->rhs, cast<CallExprAST>(B->lhs)};
+  return {};
+}
+
+// Finds the calls of the def in the tail positions of E: direct ones, and
+// accumulating ones by operator.
+static void scanTailCalls(const ExprAST *E, const TailState &TS, bool &Direct,
+                          bool &Sums, bool &Products) {
+  if (auto I = dyn_cast<IfExprAST>(E)) {
+    scanTailCalls(I->Then, TS, Direct, Sums, Products);
+    scanTailCalls(I->Else, TS, Direct, Sums, Products);
+  } else if (isSelfCall(E, TS)) {
+    Direct = true;
+  } else if (matchAccumulation(E, TS).second) {
+    (cast<BinExprAST>(E)->op == '+' ? Sums : Products) = true;
+  }
+}
+
+static Value *accumulate(char Op, Value *Acc, Value *V) {
+  if (Acc->getType()->isIntegerTy())
+    return Op == '+' ? Builder->CreateAdd(Acc, V) : Builder->CreateMul(Acc, V);
+  return Op == '+' ? Builder->CreateFAdd(Acc, V) : Builder->CreateFMul(Acc, V);
+}
+
+// Emits E in tail position, ending the block with a return of its value or
+// a jump back to the header.
+static void emitTail(ExprAST *E, TailState &TS) {
+  auto ResultTy = TS.F->getReturnType();
+  if (auto I = dyn_cast<IfExprAST>(E)) {
+    auto CondV = isTrue(I->Cond->codegen());
+    auto ThenBB = BasicBlock::Create(*TheContext, "then", TS.F);
+    auto ElseBB = BasicBlock::Create(*TheContext, "else", TS.F);
+    Builder->CreateCondBr(CondV, ThenBB, ElseBB);
+    Builder->SetInsertPoint(ThenBB);
+    emitTail(I->Then, TS);
+    Builder->SetInsertPoint(ElseBB);
+    emitTail(I->Else, TS);
+    return;
+  }
+  ExprAST *X = nullptr;
+  CallExprAST *Self = nullptr;
+  if (TS.Header && isSelfCall(E, TS))
+    Self = cast<CallExprAST>(E);
+  else if (auto B = dyn_cast<BinExprAST>(E); B && B->op == TS.Op)
+    std::tie(X, Self) = matchAccumulation(E, TS);
+  Value *XV = X ? X->codegen() : nullptr;
+  if (XV && !isa<NumExprAST>(X) && XV->getType() != ResultTy) {
+    // x Op f(...) is not computed in the result type; keep the call.
+    auto V = emitBinary(TS.Op, X, XV, Self, Self->codegen());
+    Builder->CreateRet(accumulate(TS.Op, TS.Acc, convert(V, ResultTy)));
+    return;
+  }
+  if (Self) {
+    Value *Acc = TS.Acc;
+    if (XV)
+      Acc = accumulate(TS.Op, Acc, convert(XV, ResultTy));
+    SmallVector<Value *, 6> Args;
+    for (auto arg : Self->arguments)
+      Args.push_back(
+          convert(arg->codegen(), TS.Params[Args.size()]->getType()));
+    auto BB = Builder->GetInsertBlock();
+    for (size_t I = 0; I < Args.size(); ++I)
+      TS.Params[I]->addIncoming(Args[I], BB);
+    if (TS.Acc)
+      TS.Acc->addIncoming(Acc, BB);
+    Builder->CreateBr(TS.Header);
+    return;
+  }
+  auto V = convert(E->codegen(), ResultTy);
+  if (TS.Acc) {
+    V = accumulate(TS.Op, TS.Acc, V);
+  } else if (auto Call = dyn_cast<CallInst>(V);
+             Call && isa<CallExprAST>(E)) {
+    // A callee with the same prototype can be guaranteed to reuse the frame.
+    auto Callee = Call->getCalledFunction();
+    Call->setTailCallKind(Callee && Callee->getFunctionType() ==
+                                        TS.F->getFunctionType()
+                              ? CallInst::TCK_MustTail
+                              : CallInst::TCK_Tail);
+  }
+  Builder->CreateRet(V);
+}
+
+llvm::Function *FuncAST::codegen(bool Optimize) {
+  timeTraceProfilerBegin("Codegen", proto.name.str());
+  // Reuse the declaration if an earlier call in this module created one.
+  auto func = getModuleFunction(proto.name);
+  if (!func)
+    func = proto.codegen();
   auto block = llvm::BasicBlock::Create(*TheContext, "entry", func);
   Builder->SetInsertPoint(block);
-  NamedValues.clear();
+  IRBuilderBase::FastMathFlagGuard FMFGuard(*Builder);
+  FastMathFlags FMF;
+  if (proto.fast || TheEngine->FastMath)
+    FMF.setFast();
+  Builder->setFastMathFlags(FMF);
+  TailState TS(proto.name, func);
+  bool Direct = false, Sums = false, Products = false;
+  scanTailCalls(body, TS, Direct, Sums, Products);
+  if (Sums != Products &&
+      (func->getReturnType()->isIntegerTy() || FMF.allowReassoc()))
+    TS.Op = Sums ? '+' : '*';
+  if (Direct || TS.Op) {
+    TS.Header = llvm::BasicBlock::Create(*TheContext, "tailrecurse", func);
+    Builder->CreateBr(TS.Header);
+    Builder->SetInsertPoint(TS.Header);
+  }
+  int i = 0;
   for (auto &arg : func->args()) {
-    NamedValues[arg.getName().str()] = &arg;
+    auto param = proto.parameters[i++];
+    arg.setName(param.str());
+    Value *V = &arg;
+    if (TS.Header) {
+      auto Phi = Builder->CreatePHI(arg.getType(), 2, param.str());
+      Phi->addIncoming(&arg, block);
+      TS.Params.push_back(Phi);
+      V = Phi;
+    }
+    lookupSymbol(NamedValues, param) = V;
   }
-  auto value = body->codegen();
-  Builder->CreateRet(value);
+  if (TS.Op) {
+    auto ResultTy = func->getReturnType();
+    TS.Acc = Builder->CreatePHI(ResultTy, 2, "acc");
+    // -0.0 rather than 0.0, so that a sum of -0.0 stays -0.0.
+    TS.Acc->addIncoming(
+        ResultTy->isIntegerTy()
+            ? ConstantInt::get(ResultTy, TS.Op == '+' ? 0 : 1)
+            : ConstantFP::get(ResultTy, TS.Op == '+' ? -0.0 : 1.0),
+        block);
+  }
+  emitTail(body, TS);
+  for (auto param : proto.parameters)
+    lookupSymbol(NamedValues, param) = nullptr;
   llvm::verifyFunction(*func);
-  TheFPM->run(*func, *TheFAM);
+  SmallVector<Symbol, 8> Callees;
+  if (TheEngine->Memoize && shouldMemoize(*this, &Callees))
+    memoize(func, proto.name, Callees);
+  timeTraceProfilerEnd();
+  if (Optimize) {
+    TimeTraceScope Trace("Optimize", proto.name.str());
+    OptimizeModule();
+  }
   return func;
 }
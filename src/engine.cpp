@@ -0,0 +1,488 @@
+#include "buffer.h"
+#include "check.h"
+#include "interp.h"
+#include "kale.h"
+#include "parser.h"
+#include "pfor.h"
+
+#include <iostream>
+#include <llvm/ADT/DenseSet.h>
+#include <mutex>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+namespace kale {
+
+static Error expectedExpression(const FuncAST &Def) {
+  return createStringError(inconvertibleErrorCode(),
+                           "expected an expression in '%s'",
+                           Def.proto.name.str().str().c_str());
+}
+
+Engine::Engine(const EngineOptions &Opts) : Opts(Opts) {}
+
+Engine::~Engine() {
+  // Let pipelined definitions finish. Their errors since the last flush are
+  // dropped.
+  if (Pool)
+    Pool->wait();
+  consumeError(std::move(PipelineErrors));
+  if (Opts.Profile)
+    SamplingProfiler::get().stop();
+  if (!State.Trace)
+    return;
+  // Let background recompilations finish, so that their events are written.
+  State.Tier.reset();
+  if (auto Err = timeTraceProfilerWrite(Opts.TraceFile, "kale"))
+    logAllUnhandledErrors(std::move(Err), llvm::errs(), "kale: ");
+  timeTraceProfilerCleanup();
+}
+
+Expected<std::unique_ptr<Engine>> Engine::create(const EngineOptions &Opts) {
+  static std::once_flag InitTarget;
+  std::call_once(InitTarget, [] {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+  });
+  if (Opts.Pipeline && (Opts.Mode != CompileMode::Eager || Opts.Batch))
+    return createStringError(inconvertibleErrorCode(),
+                             "pipelining needs eager mode without batching");
+  // Parallel definitions bypass the managers of tiered and swap mode.
+  if (Opts.Parallel &&
+      (Opts.Mode == CompileMode::Tiered || Opts.Mode == CompileMode::Swap))
+    return createStringError(inconvertibleErrorCode(),
+                             "parallel compilation needs eager or lazy mode");
+  // A batch is optimized and handed to the JIT as one module.
+  if (Opts.Batch && Opts.Mode != CompileMode::Eager)
+    return createStringError(inconvertibleErrorCode(),
+                             "batching needs eager mode");
+  std::unique_ptr<Engine> E(new Engine(Opts));
+  auto JIT = KaleidoscopeJIT::Create(Opts);
+  if (!JIT)
+    return JIT.takeError();
+  E->State.JIT = std::move(*JIT);
+  E->State.OptLevel = Opts.IROptLevel;
+  E->State.Verbose = Opts.Verbose;
+  E->State.FastMath = Opts.FastMath;
+  E->State.InlineBudget = Opts.InlineBudget;
+  E->State.RetainDefinitions = Opts.RetainDefinitions;
+  E->State.Memoize = Opts.Memoize;
+  E->State.MemoSize = Opts.MemoSize;
+  if (auto Err = E->State.JIT->defineRuntimeSymbol(
+          "kale_pfor", ExecutorAddr::fromPtr(&kale_pfor)))
+    return Err;
+  if (auto Err = E->State.JIT->defineRuntimeSymbol(
+          "kale_memo_lookup", ExecutorAddr::fromPtr(&kale_memo_lookup)))
+    return Err;
+  if (auto Err = E->State.JIT->defineRuntimeSymbol(
+          "kale_memo_store", ExecutorAddr::fromPtr(&kale_memo_store)))
+    return Err;
+  if (auto Err = E->State.JIT->defineRuntimeSymbol(
+          "kale_bounds_fail", ExecutorAddr::fromPtr(&kale_bounds_fail)))
+    return Err;
+  if (Opts.Mode == CompileMode::Swap) {
+    E->State.Swap = std::make_unique<SwapManager>(E->State);
+    // Callers must reach a redefinition through the stub, not a copy.
+    E->State.InlineBudget = 0;
+  }
+  if (Opts.Mode == CompileMode::Tiered) {
+    E->State.Tier =
+        std::make_unique<TierManager>(E->State, Opts.TierThreshold);
+    if (auto Err = E->State.JIT->defineRuntimeSymbol(
+            "kale_tier_up", ExecutorAddr::fromPtr(&kale_tier_up)))
+      return Err;
+  }
+  if (Opts.Parallel || Opts.Pipeline)
+    E->Pool =
+        std::make_unique<ThreadPool>(hardware_concurrency(Opts.Threads));
+  if (Opts.Profile)
+    if (auto Err = SamplingProfiler::get().start(Opts.ProfileRate))
+      return Err;
+  if (!Opts.TraceFile.empty()) {
+    if (timeTraceProfilerEnabled())
+      return createStringError(inconvertibleErrorCode(),
+                               "this thread is already recording a trace");
+    timeTraceProfilerInitialize(Opts.TraceGranularity, "kale");
+    E->State.Trace = true;
+    E->State.TraceGranularity = Opts.TraceGranularity;
+  }
+  return E;
+}
+
+Error Engine::compile(StringRef Source) {
+  Parser P;
+  P.openBuffer(Source);
+  P.getNextToken();
+  while (true) {
+    switch (P.getToken()) {
+    case tok_eof:
+      return flush();
+    case tok_ext:
+      if (auto Proto = P.parseExt())
+        addExtern(*Proto);
+      else
+        return createStringError(inconvertibleErrorCode(),
+                                 "expected a prototype after 'ext'");
+      break;
+    case tok_def:
+      if (auto Err = addDefinition(P.parseFunc()))
+        return Err;
+      break;
+    case ';':
+      P.consume(';');
+      break;
+    default:
+      if (auto Value = evaluate(P.parseTopLevelExpr()); !Value)
+        return Value.takeError();
+    }
+  }
+}
+
+void Engine::addExtern(const ProtoTypeAST &Proto) {
+  EngineScope Scope(State);
+  addFunctionProto(Proto);
+  if (Opts.Verbose >= Verbosity::AST)
+    Proto.dump();
+}
+
+// Compiles Def into the calling thread's module and hands it to the JIT.
+Error Engine::compileDefinition(FuncAST &Def) {
+  EnsureModule();
+  Def.codegen();
+  if (Opts.Verbose >= Verbosity::IR) {
+    TheModule->print(llvm::errs(), nullptr);
+    std::cerr << std::endl;
+  }
+  return State.JIT->addModule(TakeModule());
+}
+
+// Compiles Def to an object on a pool thread, then links it after the
+// definitions added before it.
+void Engine::pipelineDefinition(FuncAST &Def, uint64_t Ticket) {
+  EngineScope Scope(State);
+  EnsureModule();
+  Def.codegen();
+  if (Opts.Verbose >= Verbosity::IR) {
+    TheModule->print(llvm::errs(), nullptr);
+    std::cerr << std::endl;
+  }
+  auto Obj = State.JIT->compileModule(TakeModule());
+  std::unique_lock<std::mutex> Lock(PipelineMutex);
+  PipelineLinked.wait(Lock, [&] { return Linked == Ticket; });
+  auto Err = Obj ? State.JIT->addObject(std::move(*Obj)) : Obj.takeError();
+  PipelineErrors = joinErrors(std::move(PipelineErrors), std::move(Err));
+  ++Linked;
+  PipelineLinked.notify_all();
+}
+
+static void collectCallees(const ExprAST *E, SmallVectorImpl<Symbol> &Callees) {
+  if (auto Call = dyn_cast<CallExprAST>(E))
+    Callees.push_back(Call->callee);
+  forEachChild(E, [&](const ExprAST *Sub) { collectCallees(Sub, Callees); });
+}
+
+// Waits until the pipelined definitions that E calls, directly or through
+// other definitions, are linked, and with them every definition added
+// before. Returns the errors of the pipelined definitions so far.
+Error Engine::waitForCallees(const ExprAST *E) {
+  SmallVector<Symbol, 8> Callees;
+  collectCallees(E, Callees);
+  std::unique_lock<std::mutex> Lock(PipelineMutex);
+  // A definition may call one that was added after it.
+  uint64_t Needed = 0;
+  DenseSet<uint32_t> Seen;
+  while (!Callees.empty()) {
+    auto Callee = Callees.pop_back_val();
+    if (Callee.id() >= Tickets.size() || !Seen.insert(Callee.id()).second)
+      continue;
+    Needed = std::max(Needed, Tickets[Callee.id()]);
+    auto &Next = PipelineCallees[Callee.id()];
+    Callees.append(Next.begin(), Next.end());
+  }
+  PipelineLinked.wait(Lock, [&] { return Linked >= Needed; });
+  return std::move(PipelineErrors);
+}
+
+Error Engine::addDefinition(FuncAST Def) {
+  if (!Def.body)
+    return expectedExpression(Def);
+  EngineScope Scope(State);
+  if (auto Err = checkDefinition(Def))
+    return Err;
+  auto ast = std::make_shared<FuncAST>(std::move(Def));
+  auto Name = ast->proto.name;
+  // Only tiered and swap mode replace definitions. Elsewhere the JIT would
+  // reject a redefinition, so it is rejected before anything can inline it.
+  bool Replaceable = State.Tier || State.Swap;
+  if (!Replaceable) {
+    std::lock_guard<std::mutex> Guard(DefinedMutex);
+    if (Name.id() >= Defined.size())
+      Defined.resize(Name.id() + 1);
+    if (Defined[Name.id()])
+      return createStringError(inconvertibleErrorCode(),
+                               "'%s' is already defined",
+                               Name.str().str().c_str());
+    Defined[Name.id()] = true;
+  }
+  auto PreviousProto = getFunctionProto(Name);
+  addFunctionProto(ast->proto);
+  auto Previous = retainDefinition(ast);
+  if (Opts.Verbose >= Verbosity::AST) {
+    ast->dump();
+    std::cerr << std::endl;
+  }
+  auto Err = publishDefinition(std::move(ast));
+  if (Err) {
+    // Later definitions must not inline, or be compiled against, a
+    // definition that the JIT did not take.
+    restoreDefinition(Name, std::move(Previous));
+    if (PreviousProto)
+      addFunctionProto(*PreviousProto);
+    if (!Replaceable) {
+      std::lock_guard<std::mutex> Guard(DefinedMutex);
+      Defined[Name.id()] = false;
+    }
+  }
+  return Err;
+}
+
+// Hands a definition to the JIT, or queues it, as the options say.
+Error Engine::publishDefinition(std::shared_ptr<FuncAST> ast) {
+  if (Opts.Pipeline) {
+    std::lock_guard<std::mutex> Guard(PipelineMutex);
+    auto Ticket = Issued++;
+    auto Id = ast->proto.name.id();
+    if (Id >= Tickets.size()) {
+      Tickets.resize(Id + 1);
+      PipelineCallees.resize(Id + 1);
+    }
+    Tickets[Id] = Ticket + 1;
+    SmallVector<Symbol, 8> Callees;
+    collectCallees(ast->body, Callees);
+    PipelineCallees[Id].assign(Callees.begin(), Callees.end());
+    Pool->async([this, ast, Ticket] { pipelineDefinition(*ast, Ticket); });
+    return Error::success();
+  }
+  if (State.Swap)
+    return State.Swap->addDefinition(std::move(ast));
+  if (Opts.Parallel) {
+    std::lock_guard<std::mutex> Guard(PendingMutex);
+    PendingDefs.push_back(std::move(ast));
+    return Error::success();
+  }
+  if (State.Tier)
+    return State.Tier->addDefinition(std::move(ast));
+  if (!Opts.Batch)
+    return compileDefinition(*ast);
+  EnsureModule();
+  ast->codegen(/*Optimize=*/false);
+  return Error::success();
+}
+
+Error Engine::flushBatch() {
+  EnsureModule();
+  if (llvm::none_of(*TheModule,
+                    [](Function &F) { return !F.isDeclaration(); }))
+    return Error::success();
+  {
+    TimeTraceScope Trace("Optimize", "batch");
+    OptimizeModule();
+  }
+  if (Opts.Verbose >= Verbosity::IR) {
+    TheModule->print(llvm::errs(), nullptr);
+    std::cerr << std::endl;
+  }
+  auto Err = State.JIT->addModule(TakeModule());
+  InitializeModule();
+  return Err;
+}
+
+Error Engine::flush() {
+  EngineScope Scope(State);
+  if (Opts.Pipeline) {
+    Pool->wait();
+    std::lock_guard<std::mutex> Guard(PipelineMutex);
+    return std::move(PipelineErrors);
+  }
+  std::vector<std::shared_ptr<FuncAST>> Defs;
+  {
+    std::lock_guard<std::mutex> Guard(PendingMutex);
+    Defs.swap(PendingDefs);
+  }
+  std::mutex ErrorsMutex;
+  Error Errors = Error::success();
+  auto Report = [&](Error Err) {
+    std::lock_guard<std::mutex> Guard(ErrorsMutex);
+    Errors = joinErrors(std::move(Errors), std::move(Err));
+  };
+  if (!Defs.empty()) {
+    // Every worker codegens and optimizes into its own thread-local context
+    // and module.
+    for (auto &ast : Defs)
+      Pool->async([&] {
+        EngineScope Scope(State);
+        Report(compileDefinition(*ast));
+      });
+    Pool->wait();
+    // Look every definition up once, so that machine code is also emitted and
+    // linked on the pool instead of by the next top-level expression.
+    for (auto &ast : Defs)
+      Pool->async([&] {
+        EngineScope Scope(State);
+        TimeTraceScope Trace("Materialize", ast->proto.name.str());
+        if (auto Sym = State.JIT->lookup(ast->proto.name.str()); !Sym)
+          Report(Sym.takeError());
+      });
+    Pool->wait();
+  }
+  if (Opts.Batch)
+    Report(flushBatch());
+  if (State.Tier)
+    Report(State.Tier->takeErrors());
+  return Errors;
+}
+
+namespace {
+// Marks an evaluation as running in swap mode, so that the code of the
+// definitions replaced meanwhile outlives it.
+class SwapScope {
+  SwapManager *Swap;
+  uint64_t Started = 0;
+
+public:
+  SwapScope(SwapManager *Swap) : Swap(Swap) {
+    if (Swap)
+      Started = Swap->enter();
+  }
+  ~SwapScope() {
+    if (Swap)
+      if (auto Err = Swap->leave(Started))
+        logAllUnhandledErrors(std::move(Err), llvm::errs(), "kale: ");
+  }
+};
+} // namespace
+
+// The address of a def or ext of TheEngine with Arity parameters, for the
+// interpreter.
+static void *resolveCallee(Symbol Name, size_t Arity) {
+  auto Proto = getFunctionProto(Name);
+  if (!Proto || Proto->parameters.size() != Arity || !Proto->isAllF64())
+    return nullptr;
+  auto Sym = TheEngine->JIT->lookup(Name.str());
+  if (!Sym) {
+    consumeError(Sym.takeError());
+    return nullptr;
+  }
+  return Sym->getAddress().toPtr<void *>();
+}
+
+Expected<double> Engine::evaluate(FuncAST Expr) {
+  if (!Expr.body)
+    return expectedExpression(Expr);
+  EngineScope Scope(State);
+  if (auto Err = checkDefinition(Expr))
+    return Err;
+  if (auto Err = Opts.Pipeline ? waitForCallees(Expr.body) : flush())
+    return Err;
+  if (Opts.Verbose >= Verbosity::AST) {
+    Expr.body->dump();
+    std::cerr << std::endl;
+  }
+  SwapScope Running(State.Swap.get());
+  if (Opts.Interpret) {
+    Bytecode Program;
+    if (Program.compile(Expr.body, Opts.InterpretLimit, resolveCallee)) {
+      TimeTraceScope Trace("Interpret", "_expr_");
+      return Program.run();
+    }
+  }
+  EnsureModule();
+  // Expressions may be evaluated by several threads at once, so each gets a
+  // name of its own.
+  static std::atomic<uint64_t> Count;
+  auto Name = ("_expr_." + Twine(Count++)).str();
+  Expr.codegen()->setName(Name);
+  if (Opts.Verbose >= Verbosity::IR) {
+    TheModule->print(llvm::errs(), nullptr);
+    std::cerr << std::endl;
+  }
+  auto RT = State.JIT->getMainJITDylib().createResourceTracker();
+  auto Err = State.JIT->addModule(TakeModule(), RT);
+  if (Opts.Batch)
+    InitializeModule();
+  if (Err)
+    return Err;
+  auto Sym = [&] {
+    TimeTraceScope Trace("Materialize", Name);
+    return State.JIT->lookup(Name);
+  }();
+  if (!Sym)
+    return joinErrors(Sym.takeError(), RT->remove());
+  double Result;
+  {
+    TimeTraceScope Trace("Execute", Name);
+    Result = Sym->getAddress().toPtr<double (*)()>()();
+  }
+  if (auto Err = RT->remove())
+    return Err;
+  return Result;
+}
+
+std::optional<ProtoTypeAST> Engine::getPrototype(StringRef Name) {
+  EngineScope Scope(State);
+  return getFunctionProto(Symbols.intern(Name));
+}
+
+static std::string getSignature(ArrayRef<NumType> Params, NumType Result) {
+  std::string S = "(";
+  for (auto T : Params)
+    S += (S.size() > 1 ? ", " : "") + std::string(getTypeName(T));
+  return S + "): " + getTypeName(Result);
+}
+
+Expected<ExecutorAddr> Engine::lookupFunction(StringRef Name,
+                                              ArrayRef<NumType> Params,
+                                              NumType Result) {
+  auto Proto = getPrototype(Name);
+  if (!Proto)
+    return createStringError(inconvertibleErrorCode(),
+                             "no function named '%s'", Name.str().c_str());
+  if (Proto->parameters.size() != Params.size())
+    return createStringError(inconvertibleErrorCode(),
+                             "'%s' takes %zu arguments, not %zu",
+                             Name.str().c_str(), Proto->parameters.size(),
+                             Params.size());
+  if (ArrayRef<NumType>(Proto->types) != Params || Proto->result != Result)
+    return createStringError(
+        inconvertibleErrorCode(), "'%s' has type %s, not %s",
+        Name.str().c_str(),
+        getSignature(Proto->types, Proto->result).c_str(),
+        getSignature(Params, Result).c_str());
+  if (auto Err = flush())
+    return Err;
+  EngineScope Scope(State);
+  TimeTraceScope Trace("Materialize", Name);
+  auto Sym = State.JIT->lookup(Name);
+  if (!Sym)
+    return Sym.takeError();
+  return Sym->getAddress();
+}
+
+void Engine::printMemoStats(raw_ostream &OS) {
+  EngineScope Scope(State);
+  ::printMemoStats(OS);
+}
+
+void Engine::printSwapStats(raw_ostream &OS) {
+  if (State.Swap)
+    State.Swap->printStats(OS);
+}
+
+Expected<MapFunction> Engine::map(StringRef Name) {
+  EngineScope Scope(State);
+  return compileMap(Symbols.intern(Name));
+}
+
+} // namespace kale
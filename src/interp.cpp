@@ -0,0 +1,163 @@
+#include "interp.h"
+
+#include <algorithm>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Support/ErrorHandling.h>
+
+using namespace llvm;
+
+Bytecode::Instr &Bytecode::push(Op Opcode, int Effect) {
+  Depth += Effect;
+  MaxDepth = std::max(MaxDepth, Depth);
+  return Code.emplace_back(Opcode);
+}
+
+bool Bytecode::emit(const ExprAST *E, unsigned &Budget, Resolver Resolve) {
+  if (!Budget--)
+    return false;
+  switch (E->kind) {
+  case ExprAST::Num:
+    push(Op::Num, 1).Value = cast<NumExprAST>(E)->val;
+    return true;
+  case ExprAST::Bin: {
+    auto B = cast<BinExprAST>(E);
+    if (!emit(B->lhs, Budget, Resolve) || !emit(B->rhs, Budget, Resolve))
+      return false;
+    switch (B->op) {
+    case '<':
+      push(Op::Less, -1);
+      return true;
+    case '+':
+      push(Op::Add, -1);
+      return true;
+    case '-':
+      push(Op::Sub, -1);
+      return true;
+    case '*':
+      push(Op::Mul, -1);
+      return true;
+    default:
+      return false;
+    }
+  }
+  case ExprAST::Call: {
+    auto C = cast<CallExprAST>(E);
+    if (C->arguments.size() > MaxArity)
+      return false;
+    auto Callee = Resolve(C->callee, C->arguments.size());
+    if (!Callee)
+      return false;
+    for (auto arg : C->arguments)
+      if (!emit(arg, Budget, Resolve))
+        return false;
+    auto &I = push(Op::Call, 1 - int(C->arguments.size()));
+    I.Arg = C->arguments.size();
+    I.Callee = Callee;
+    return true;
+  }
+  case ExprAST::If: {
+    // Cond, JumpIfZero Else, Then, Jump End, Else: Else, End:
+    auto I = cast<IfExprAST>(E);
+    if (!emit(I->Cond, Budget, Resolve))
+      return false;
+    auto ToElse = Code.size();
+    push(Op::JumpIfZero, -1);
+    if (!emit(I->Then, Budget, Resolve))
+      return false;
+    auto ToEnd = Code.size();
+    push(Op::Jump, 0);
+    // Only one of the branches leaves its value on the stack.
+    --Depth;
+    Code[ToElse].Arg = Code.size();
+    if (!emit(I->Else, Budget, Resolve))
+      return false;
+    Code[ToEnd].Arg = Code.size();
+    return true;
+  }
+  case ExprAST::Var:
+  case ExprAST::For:
+  case ExprAST::PFor:
+  case ExprAST::Index:
+    return false;
+  }
+  return false;
+}
+
+bool Bytecode::compile(const ExprAST *E, unsigned Limit, Resolver Resolve) {
+  Code.clear();
+  Depth = MaxDepth = 0;
+  return emit(E, Limit, Resolve);
+}
+
+static double call(void *F, unsigned Arity, const double *A) {
+  switch (Arity) {
+  case 0:
+    return reinterpret_cast<double (*)()>(F)();
+  case 1:
+    return reinterpret_cast<double (*)(double)>(F)(A[0]);
+  case 2:
+    return reinterpret_cast<double (*)(double, double)>(F)(A[0], A[1]);
+  case 3:
+    return reinterpret_cast<double (*)(double, double, double)>(F)(
+        A[0], A[1], A[2]);
+  case 4:
+    return reinterpret_cast<double (*)(double, double, double, double)>(F)(
+        A[0], A[1], A[2], A[3]);
+  case 5:
+    return reinterpret_cast<double (*)(double, double, double, double,
+                                       double)>(F)(A[0], A[1], A[2], A[3],
+                                                   A[4]);
+  case 6:
+    return reinterpret_cast<double (*)(double, double, double, double, double,
+                                       double)>(F)(A[0], A[1], A[2], A[3],
+                                                   A[4], A[5]);
+  }
+  llvm_unreachable("compile() rejects calls with more arguments");
+}
+
+// The operations follow the IR that codegen() emits: `<` is an unordered
+// comparison, and a condition holds when it compares ordered and not equal
+// to zero.
+double Bytecode::run() const {
+  SmallVector<double, 32> Stack(MaxDepth);
+  auto SP = Stack.data();
+  for (size_t PC = 0; PC < Code.size();) {
+    auto &I = Code[PC++];
+    switch (I.Code) {
+    case Op::Num:
+      *SP++ = I.Value;
+      break;
+    case Op::Add:
+      --SP;
+      SP[-1] += SP[0];
+      break;
+    case Op::Sub:
+      --SP;
+      SP[-1] -= SP[0];
+      break;
+    case Op::Mul:
+      --SP;
+      SP[-1] *= SP[0];
+      break;
+    case Op::Less:
+      --SP;
+      SP[-1] = !(SP[-1] >= SP[0]);
+      break;
+    case Op::Call:
+      SP -= I.Arg;
+      *SP = call(I.Callee, I.Arg, SP);
+      ++SP;
+      break;
+    case Op::JumpIfZero: {
+      double Cond = *--SP;
+      if (!(Cond < 0 || Cond > 0))
+        PC = I.Arg;
+      break;
+    }
+    case Op::Jump:
+      PC = I.Arg;
+      break;
+    }
+  }
+  return SP[-1];
+}
@@ -0,0 +1,280 @@
+#include <iostream>
+#include <optional>
+
+#include "ast.h"
+#include "check.h"
+#include "jit.h"
+#include "llvm.h"
+#include "parser.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Ahead-of-time driver: compiles every `def` of a source file into a single
+// module and writes it out as LLVM IR, assembly, an object file or a shared
+// library. Each def becomes an external function callable from C, taking and
+// returning doubles unless annotated with f32 (float) or i64 (int64_t).
+
+enum class FileType { LLVM, Asm, Obj, Shared };
+
+static cl::OptionCategory KalecCategory("kalec options");
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input file>"),
+                                          cl::init("-"),
+                                          cl::cat(KalecCategory));
+
+static cl::opt<std::string> OutputFilename("o", cl::desc("Output filename"),
+                                           cl::value_desc("filename"),
+                                           cl::cat(KalecCategory));
+
+static cl::opt<FileType> Emit(
+    "filetype", cl::desc("Kind of output to write:"),
+    cl::values(clEnumValN(FileType::LLVM, "ll", "LLVM IR"),
+               clEnumValN(FileType::Asm, "asm", "assembly"),
+               clEnumValN(FileType::Obj, "obj", "object file"),
+               clEnumValN(FileType::Shared, "so", "shared library")),
+    cl::init(FileType::Obj), cl::cat(KalecCategory));
+
+static cl::opt<std::string>
+    HeaderFilename("header",
+                   cl::desc("Also write a C header declaring every def"),
+                   cl::value_desc("filename"), cl::cat(KalecCategory));
+
+static cl::opt<std::string> MTriple("mtriple", cl::desc("Target triple"),
+                                    cl::cat(KalecCategory));
+
+static cl::opt<std::string> MCPU("mcpu", cl::desc("Target CPU"),
+                                 cl::cat(KalecCategory));
+
+static cl::opt<char>
+    OptLevel("O",
+             cl::desc("Optimization level: -O0, -O1, -O2 or -O3 "
+                      "(default: -O2)"),
+             cl::Prefix, cl::init('2'), cl::cat(KalecCategory));
+
+static cl::opt<std::string>
+    Linker("linker", cl::desc("Compiler driver used to link shared libraries"),
+           cl::init("cc"), cl::cat(KalecCategory));
+
+static cl::opt<bool>
+    FastMath("fast-math",
+             cl::desc("Compile every def with fast-math flags, as if it were "
+                      "declared `def fast`"),
+             cl::cat(KalecCategory));
+
+static cl::opt<bool>
+    ShowASTStats("ast-stats",
+                 cl::desc("Print front-end node counts, arena usage, parse "
+                          "throughput and peak memory"),
+                 cl::cat(KalecCategory));
+
+Parser parser;
+std::vector<ProtoTypeAST> Defs;
+
+static std::string getOutputFilename() {
+  if (!OutputFilename.empty())
+    return OutputFilename;
+  SmallString<128> Path(InputFilename == "-" ? "a" : InputFilename.getValue());
+  switch (Emit) {
+  case FileType::LLVM:
+    sys::path::replace_extension(Path, "ll");
+    break;
+  case FileType::Asm:
+    sys::path::replace_extension(Path, "s");
+    break;
+  case FileType::Obj:
+    sys::path::replace_extension(Path, "o");
+    break;
+  case FileType::Shared:
+    sys::path::replace_extension(Path, "so");
+    break;
+  }
+  return std::string(Path);
+}
+
+static const char *getCTypeName(NumType T) {
+  switch (T) {
+  case NumType::F64:
+    return "double";
+  case NumType::F32:
+    return "float";
+  case NumType::I64:
+    return "int64_t";
+  case NumType::Buf:
+    return "kale_buf *";
+  }
+  return nullptr;
+}
+
+static void writeHeader(StringRef Filename) {
+  std::error_code EC;
+  ToolOutputFile Out(Filename, EC, sys::fs::OF_Text);
+  if (EC)
+    ExitOnErr(createFileError(Filename, EC));
+  auto &OS = Out.os();
+  OS << "#pragma once\n\n#include <stdint.h>\n\n"
+     << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n"
+     << "// The descriptor of a buf parameter, shared by every kalec header.\n"
+     << "#ifndef KALE_BUF_DEFINED\n#define KALE_BUF_DEFINED\n"
+     << "typedef struct {\n  double *data;\n  int64_t size;\n} kale_buf;\n"
+     << "#endif\n\n";
+  for (auto &proto : Defs) {
+    OS << getCTypeName(proto.result) << ' ' << proto.name.str() << '(';
+    for (size_t i = 0; i < proto.parameters.size(); ++i)
+      OS << (i ? ", " : "") << getCTypeName(proto.types[i]) << ' '
+         << proto.parameters[i].str();
+    OS << ");\n";
+  }
+  OS << "\n#ifdef __cplusplus\n}\n#endif\n";
+  Out.keep();
+}
+
+static void emitFile(TargetMachine &TM, StringRef Filename, FileType Kind) {
+  std::error_code EC;
+  ToolOutputFile Out(Filename, EC,
+                     Kind == FileType::Obj ? sys::fs::OF_None
+                                           : sys::fs::OF_Text);
+  if (EC)
+    ExitOnErr(createFileError(Filename, EC));
+  if (Kind == FileType::LLVM) {
+    TheModule->print(Out.os(), nullptr);
+  } else {
+    legacy::PassManager PM;
+    auto CGFT = Kind == FileType::Obj ? CodeGenFileType::ObjectFile
+                                      : CodeGenFileType::AssemblyFile;
+    if (TM.addPassesToEmitFile(PM, Out.os(), nullptr, CGFT)) {
+      errs() << "kalec: target cannot emit this file type\n";
+      exit(1);
+    }
+    PM.run(*TheModule);
+  }
+  Out.keep();
+}
+
+static void emitSharedLibrary(TargetMachine &TM, StringRef Filename) {
+  SmallString<128> ObjPath;
+  if (auto EC = sys::fs::createTemporaryFile("kalec", "o", ObjPath))
+    ExitOnErr(createFileError("temporary object file", EC));
+  FileRemover RemoveObj(ObjPath);
+  emitFile(TM, ObjPath, FileType::Obj);
+  auto Program = sys::findProgramByName(Linker);
+  if (!Program)
+    ExitOnErr(createFileError(Linker, Program.getError()));
+  std::string Output = Filename.str();
+  std::string Object = ObjPath.str().str();
+  StringRef Args[] = {*Program, "-shared", "-o", Output, Object};
+  std::string ErrMsg;
+  if (sys::ExecuteAndWait(*Program, Args, std::nullopt, {}, 0, 0, &ErrMsg)) {
+    errs() << "kalec: linking " << Filename << " failed";
+    if (!ErrMsg.empty())
+      errs() << ": " << ErrMsg;
+    errs() << "\n";
+    exit(1);
+  }
+}
+
+static int finish(TargetMachine &TM) {
+  if (verifyModule(*TheModule, &errs()))
+    return 1;
+  // Optimize all defs together, so the pipeline can inline across them.
+  OptimizeModule();
+  auto Output = getOutputFilename();
+  if (Emit == FileType::Shared)
+    emitSharedLibrary(TM, Output);
+  else
+    emitFile(TM, Output, Emit);
+  if (!HeaderFilename.empty())
+    writeHeader(HeaderFilename);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  cl::HideUnrelatedOptions(KalecCategory);
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope AOT compiler\n");
+  ExitOnErr.setBanner("kalec: ");
+  if (auto EC = parser.open(InputFilename)) {
+    errs() << "kalec: cannot open " << InputFilename << ": " << EC.message()
+           << "\n";
+    return 1;
+  }
+
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  InitializeNativeTargetAsmParser();
+
+  std::string TT = MTriple.empty() ? sys::getDefaultTargetTriple() : MTriple;
+  std::string Error;
+  auto Target = TargetRegistry::lookupTarget(TT, Error);
+  if (!Target) {
+    errs() << "kalec: " << Error << "\n";
+    return 1;
+  }
+  // There is no JIT; the state only holds prototypes and the IR pipeline.
+  EngineState State;
+  EngineScope Scope(State);
+  State.FastMath = FastMath;
+  auto Levels = getOptLevels(OptLevel);
+  if (!Levels) {
+    errs() << "kalec: invalid optimization level -O" << OptLevel << "\n";
+    return 1;
+  }
+  auto CGOptLevel = Levels->second;
+  State.OptLevel = Levels->first;
+  // Position independent code links into executables and shared libraries.
+  TheTM.reset(Target->createTargetMachine(
+      TT, MCPU, "", TargetOptions(), Reloc::PIC_, std::nullopt, CGOptLevel));
+
+  InitializeModuleAndManagers();
+  parser.getNextToken();
+  while (true) {
+    switch (parser.getToken()) {
+    case tok_eof:
+      if (ShowASTStats)
+        TheASTStats.print(errs());
+      return finish(*TheTM);
+    case tok_ext: {
+      auto ast = parser.parseExt();
+      if (!ast) {
+        errs() << "kalec: expected a prototype after 'ext'\n";
+        return 1;
+      }
+      addFunctionProto(*ast);
+      break;
+    }
+    case tok_def: {
+      auto ast = parser.parseFunc();
+      if (!ast.body) {
+        errs() << "kalec: expected an expression in " << ast.proto.name.str()
+               << "\n";
+        return 1;
+      }
+      if (auto Err = checkDefinition(ast)) {
+        logAllUnhandledErrors(std::move(Err), errs(), "kalec: ");
+        return 1;
+      }
+      if (auto F = TheModule->getFunction(ast.proto.name.str());
+          F && !F->isDeclaration()) {
+        errs() << "kalec: redefinition of " << ast.proto.name.str() << "\n";
+        return 1;
+      }
+      addFunctionProto(ast.proto);
+      Defs.push_back(ast.proto);
+      ast.codegen(/*Optimize=*/false);
+      break;
+    }
+    case ';':
+      parser.consume(';');
+      break;
+    default:
+      // There is no process to evaluate top-level expressions in. A token
+      // that cannot start one is not consumed, so it ends the compilation.
+      if (!parser.parseTopLevelExpr().body) {
+        errs() << "kalec: expected an expression\n";
+        return 1;
+      }
+      errs() << "kalec: ignoring top-level expression\n";
+    }
+  }
+  return 0;
+}
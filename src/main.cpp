@@ -1,54 +1,302 @@
+#include <chrono>
 #include <iostream>
+#include <tuple>
 
-#include "ast.h"
-#include "jit.h"
+#include "kale.h"
 #include "llvm.h"
 #include "parser.h"
+#include "stream.h"
+
+using namespace llvm;
+using namespace llvm::orc;
+
+static cl::OptionCategory KaleCategory("kale options");
+
+static cl::opt<std::string> InputFilename(cl::Positional,
+                                          cl::desc("<input file>"),
+                                          cl::init("-"), cl::cat(KaleCategory));
+
+static cl::opt<CompileMode> Mode(
+    "mode", cl::desc("How definitions are compiled:"),
+    cl::values(clEnumValN(CompileMode::Eager, "eager",
+                          "compile a whole definition when it is first used"),
+               clEnumValN(CompileMode::Lazy, "lazy",
+                          "compile each function on its first call"),
+               clEnumValN(CompileMode::Tiered, "tiered",
+                          "compile at -O0 first and recompile hot functions "
+                          "at -O3 in the background"),
+               clEnumValN(CompileMode::Swap, "swap",
+                          "compile each definition behind a stub, so that "
+                          "redefining it swaps the code in place")),
+    cl::init(CompileMode::Eager), cl::cat(KaleCategory));
+
+static cl::opt<unsigned>
+    TierThreshold("tier-threshold",
+                  cl::desc("Calls after which --mode=tiered recompiles a "
+                           "function at -O3"),
+                  cl::init(1000), cl::cat(KaleCategory));
+
+static cl::opt<char>
+    OptLevel("O",
+             cl::desc("Optimization level: -O0, -O1, -O2 or -O3 "
+                      "(default: -O2)"),
+             cl::Prefix, cl::init('2'), cl::cat(KaleCategory));
+
+static cl::opt<std::string>
+    MCPU("mcpu",
+         cl::desc("Generate code for this CPU instead of the host CPU, so "
+                  "that the output does not depend on the machine"),
+         cl::value_desc("cpu-name"), cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    Parallel("parallel",
+             cl::desc("Compile runs of consecutive definitions in parallel, "
+                      "flushing them before each top-level expression"),
+             cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    Pipeline("pipeline",
+             cl::desc("Compile each definition in the background as soon as "
+                      "it is parsed; expressions only wait for the "
+                      "definitions they call"),
+             cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    Batch("batch",
+          cl::desc("Collect definitions into one module in a reused context, "
+                   "and only hand it to the JIT when an expression runs"),
+          cl::cat(KaleCategory));
+
+static cl::opt<unsigned>
+    Threads("threads",
+            cl::desc("Number of compile threads for --parallel and "
+                     "--pipeline (default: one per core)"),
+            cl::init(0), cl::cat(KaleCategory));
+
+static cl::opt<std::string>
+    CacheDir("cache-dir",
+             cl::desc("Reuse compiled object files from this directory "
+                      "across runs"),
+             cl::value_desc("dir"), cl::cat(KaleCategory));
+
+static cl::opt<unsigned>
+    CacheSizeMB("cache-size",
+                cl::desc("Evict old cache entries beyond this many MiB "
+                         "(0: unlimited)"),
+                cl::init(512), cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    Interpret("interpret",
+              cl::desc("Interpret top-level expressions without loops "
+                       "instead of compiling them (default: on)"),
+              cl::init(true), cl::cat(KaleCategory));
+
+static cl::opt<unsigned>
+    InterpretLimit("interpret-limit",
+                   cl::desc("Compile top-level expressions with more nodes "
+                            "than this even without loops"),
+                   cl::init(1000), cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    FastMath("fast-math",
+             cl::desc("Compile every def with fast-math flags, as if it were "
+                      "declared `def fast`"),
+             cl::cat(KaleCategory));
+
+static cl::opt<unsigned>
+    InlineBudget("inline-budget",
+                 cl::desc("Let defs inline earlier defs of at most this many "
+                          "AST nodes (0: never)"),
+                 cl::init(40), cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    Memoize("memoize",
+            cl::desc("Cache the results of defs that call themselves and no "
+                     "ext, even indirectly"),
+            cl::cat(KaleCategory));
+
+static cl::opt<unsigned>
+    MemoSize("memo-size",
+             cl::desc("Entries of the --memoize table of every def"),
+             cl::init(4096), cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    SwapStats("swap-stats",
+              cl::desc("Print the latency of redefinitions in --mode=swap "
+                       "at exit"),
+              cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    MemoStats("memo-stats",
+              cl::desc("Print the hit rate of every --memoize table at exit"),
+              cl::cat(KaleCategory));
+
+static cl::opt<Verbosity> Verbose(
+    "verbose", cl::desc("What to print to stderr while compiling:"),
+    cl::values(clEnumValN(Verbosity::Silent, "silent", "nothing (default)"),
+               clEnumValN(Verbosity::AST, "ast", "the AST of every item"),
+               clEnumValN(Verbosity::IR, "ir", "ASTs and generated IR"),
+               clEnumValN(Verbosity::Passes, "passes",
+                          "ASTs, IR and every optimization pass run")),
+    cl::init(Verbosity::Silent), cl::cat(KaleCategory));
+
+static cl::opt<std::string>
+    TraceFile("trace",
+              cl::desc("Write a Chrome trace (chrome://tracing, Perfetto) "
+                       "of the parse, codegen, optimization, object emission, "
+                       "linking and execution of every item, with per-phase "
+                       "totals, to this file at exit"),
+              cl::value_desc("file"), cl::cat(KaleCategory));
+
+static cl::opt<unsigned>
+    TraceGranularity("trace-granularity",
+                     cl::desc("Leave events shorter than this many "
+                              "microseconds out of the --trace"),
+                     cl::init(0), cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    PerfMap("perf-map",
+            cl::desc("Write /tmp/perf-<pid>.map, so that perf report names "
+                     "JIT'd functions"),
+            cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    JITDump("jitdump",
+            cl::desc("Write a jitdump for perf inject --jit, so that perf "
+                     "can also annotate JIT'd functions"),
+            cl::cat(KaleCategory));
+
+static cl::opt<bool> GDB("gdb", cl::desc("Register JIT'd code with GDB"),
+                         cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    Profile("profile",
+            cl::desc("Sample the running code and print the hottest "
+                     "functions at exit"),
+            cl::cat(KaleCategory));
+
+static cl::opt<unsigned>
+    ProfileRate("profile-rate",
+                cl::desc("Samples per second of CPU time for --profile"),
+                cl::init(1000), cl::cat(KaleCategory));
+
+static cl::opt<bool>
+    ShowASTStats("ast-stats",
+                 cl::desc("Print front-end node counts, arena usage, parse "
+                          "throughput and peak memory at exit"),
+                 cl::cat(KaleCategory));
+
+static cl::opt<std::string>
+    MapName("map",
+            cl::desc("At the end of the input, evaluate this def over the "
+                     "--map-input columns and write --map-output"),
+            cl::value_desc("def"), cl::cat(KaleCategory));
+
+static cl::list<std::string>
+    MapInputs("map-input",
+              cl::desc("Files of native-endian doubles, one per parameter "
+                       "of the --map def, or one CSV file"),
+              cl::value_desc("file,..."), cl::CommaSeparated,
+              cl::cat(KaleCategory));
+
+static cl::opt<InputFormat> MapFormat(
+    "map-format", cl::desc("Format of the --map-input:"),
+    cl::values(clEnumValN(InputFormat::Columns, "columns",
+                          "a file of doubles per column (default)"),
+               clEnumValN(InputFormat::CSV, "csv",
+                          "one file of comma-separated numbers, a row per "
+                          "line")),
+    cl::init(InputFormat::Columns), cl::cat(KaleCategory));
+
+static cl::opt<unsigned>
+    MapChunk("map-chunk",
+             cl::desc("KiB of input and results per parallel chunk of "
+                      "--map"),
+             cl::init(256), cl::cat(KaleCategory));
+
+static cl::opt<unsigned>
+    MapWindow("map-window",
+              cl::desc("MiB of input that --map holds at a time"),
+              cl::init(16), cl::cat(KaleCategory));
+
+static cl::opt<std::string>
+    MapOutput("map-output", cl::desc("File to write the --map results to"),
+              cl::value_desc("file"), cl::cat(KaleCategory));
 
 Parser parser;
+std::unique_ptr<kale::Engine> TheKale;
+
+// Parse errors leave the parser on the offending token; skip it so that the
+// loop makes progress.
+static bool checkParsed(const FuncAST &ast) {
+  if (ast.body)
+    return true;
+  errs() << "kale: expected an expression\n";
+  parser.getNextToken();
+  return false;
+}
 
 void handleExt() {
-  auto ast = parser.parseExt();
-  FunctionProtos.insert_or_assign(ast.name, ast);
-  ast.dump();
-  std::cerr << std::endl;
-  ast.codegen();
-  TheModule->print(llvm::errs(), nullptr);
-  std::cerr << std::endl;
-  auto TSM =
-      llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-  ExitOnErr(TheJIT->addModule(std::move(TSM)));
-  InitializeModuleAndManagers();
+  if (auto Proto = parser.parseExt()) {
+    TheKale->addExtern(*Proto);
+    return;
+  }
+  errs() << "kale: expected a prototype after 'ext'\n";
+  parser.getNextToken();
 }
 void handleDef() {
   auto ast = parser.parseFunc();
-  FunctionProtos.insert_or_assign(ast.proto.name, ast.proto);
-  ast.dump();
-  std::cerr << std::endl;
-  ast.codegen();
-  TheModule->print(llvm::errs(), nullptr);
-  std::cerr << std::endl;
-  auto TSM =
-      llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-  ExitOnErr(TheJIT->addModule(std::move(TSM)));
-  InitializeModuleAndManagers();
+  if (!checkParsed(ast))
+    return;
+  if (auto Err = TheKale->addDefinition(std::move(ast)))
+    logAllUnhandledErrors(std::move(Err), llvm::errs(), "kale: ");
 }
 void handleExp() {
-  auto ast = FuncAST(ProtoTypeAST("_expr_", {}), parser.parseExpr());
-  ast.body->dump();
-  std::cerr << std::endl;
-  ast.codegen();
-  TheModule->print(llvm::errs(), nullptr);
-  std::cerr << std::endl;
-  auto RT = TheJIT->getMainJITDylib().createResourceTracker();
-  auto TSM =
-      llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext));
-  ExitOnErr(TheJIT->addModule(std::move(TSM), RT));
-  InitializeModuleAndManagers();
-  auto ExprSymbol = ExitOnErr(TheJIT->lookup("_expr_"));
-  double (*FP)() = ExprSymbol.getAddress().toPtr<double (*)()>();
-  std::cerr << FP() << std::endl;
-  ExitOnErr(RT->remove());
+  auto ast = parser.parseTopLevelExpr();
+  if (!checkParsed(ast))
+    return;
+  if (auto Value = TheKale->evaluate(std::move(ast)))
+    std::cerr << *Value << std::endl;
+  else
+    logAllUnhandledErrors(Value.takeError(), llvm::errs(), "kale: ");
+}
+
+int runMap() {
+  auto Map = TheKale->map(MapName);
+  if (!Map) {
+    logAllUnhandledErrors(Map.takeError(), llvm::errs(), "kale: ");
+    return 1;
+  }
+  auto Arity = TheKale->getPrototype(MapName)->parameters.size();
+  size_t Files = MapFormat == InputFormat::CSV ? 1 : Arity;
+  if (MapInputs.size() != Files) {
+    errs() << "kale: " << MapName << " takes " << Files << " input files, got "
+           << MapInputs.size() << "\n";
+    return 1;
+  }
+  StreamOptions Opts;
+  Opts.ChunkBytes = uint64_t(MapChunk) << 10;
+  Opts.WindowBytes = uint64_t(MapWindow) << 20;
+  auto Start = std::chrono::steady_clock::now();
+  auto Stats = [&] {
+    TimeTraceScope Trace("Execute", MapName);
+    if (MapFormat == InputFormat::CSV)
+      return streamCSV(*Map, Arity, MapInputs[0], MapOutput, Opts);
+    return streamColumns(*Map, MapInputs, MapOutput, Opts);
+  }();
+  std::chrono::duration<double> Time = std::chrono::steady_clock::now() - Start;
+  if (!Stats) {
+    logAllUnhandledErrors(Stats.takeError(), llvm::errs(), "kale: ");
+    return 1;
+  }
+  double Seconds = std::max(Time.count(), 1e-9);
+  errs() << "kale: mapped " << Stats->Rows << " rows in "
+         << format("%.3f s (%.0f rows/s, %.1f MB/s in, %.1f MB/s out)",
+                   Time.count(), Stats->Rows / Seconds,
+                   Stats->BytesIn / Seconds / 1e6,
+                   Stats->BytesOut / Seconds / 1e6)
+         << "\n";
+  return 0;
 }
 
 extern "C" double greet(double x) {
@@ -56,16 +304,76 @@ extern "C" double greet(double x) {
   return x;
 }
 
-int main() {
-  llvm::InitializeNativeTarget();
-  llvm::InitializeNativeTargetAsmPrinter();
-  llvm::InitializeNativeTargetAsmParser();
-  TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
-  InitializeModuleAndManagers();
+int main(int argc, char **argv) {
+  cl::HideUnrelatedOptions(KaleCategory);
+  cl::ParseCommandLineOptions(argc, argv, "Kaleidoscope JIT\n");
+  ExitOnErr.setBanner("kale: ");
+  if (!MapName.empty() && MapOutput.empty()) {
+    errs() << "kale: --map needs --map-output\n";
+    return 1;
+  }
+  if (auto EC = parser.open(InputFilename)) {
+    errs() << "kale: cannot open " << InputFilename << ": " << EC.message()
+           << "\n";
+    return 1;
+  }
+  kale::EngineOptions Opts;
+  Opts.Mode = Mode;
+  Opts.CPU = MCPU;
+  auto Levels = getOptLevels(OptLevel);
+  if (!Levels) {
+    errs() << "kale: invalid optimization level -O" << OptLevel << "\n";
+    return 1;
+  }
+  std::tie(Opts.IROptLevel, Opts.OptLevel) = *Levels;
+  Opts.CacheDir = CacheDir;
+  Opts.CacheSizeLimit = uint64_t(CacheSizeMB) << 20;
+  Opts.PerfMap = PerfMap;
+  Opts.JITDump = JITDump;
+  Opts.GDB = GDB;
+  Opts.Profile = Profile;
+  Opts.ProfileRate = ProfileRate;
+  Opts.TierThreshold = TierThreshold;
+  Opts.Batch = Batch;
+  Opts.Parallel = Parallel;
+  Opts.Pipeline = Pipeline;
+  Opts.Threads = Threads;
+  Opts.Interpret = Interpret;
+  Opts.InterpretLimit = InterpretLimit;
+  Opts.FastMath = FastMath;
+  Opts.InlineBudget = InlineBudget;
+  Opts.RetainDefinitions = !MapName.empty();
+  Opts.Memoize = Memoize;
+  Opts.MemoSize = MemoSize;
+  Opts.Verbose = Verbose;
+  Opts.TraceFile = TraceFile;
+  Opts.TraceGranularity = TraceGranularity;
+  TheKale = ExitOnErr(kale::Engine::create(Opts));
+  parser.getNextToken();
   while (true) {
     switch (parser.getToken()) {
-    case tok_eof:
-      return 0;
+    case tok_eof: {
+      int Status = 0;
+      if (auto Err = TheKale->flush()) {
+        logAllUnhandledErrors(std::move(Err), llvm::errs(), "kale: ");
+        Status = 1;
+      }
+      if (!MapName.empty())
+        Status |= runMap();
+      if (auto *Cache = TheKale->getObjectCache())
+        Cache->printStats(llvm::errs());
+      if (MemoStats)
+        TheKale->printMemoStats(llvm::errs());
+      if (SwapStats)
+        TheKale->printSwapStats(llvm::errs());
+      if (ShowASTStats)
+        TheASTStats.print(llvm::errs());
+      // Let background recompilations finish before the JIT goes away.
+      TheKale.reset();
+      if (Profile)
+        SamplingProfiler::get().report(llvm::errs());
+      return Status;
+    }
     case tok_ext:
       handleExt();
       break;
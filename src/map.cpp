@@ -0,0 +1,203 @@
+#include "map.h"
+#include "jit.h"
+#include "llvm.h"
+
+#include <atomic>
+#include <future>
+#include <mutex>
+#include <vector>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Counts the nodes of E, stopping early past Limit.
+static unsigned countNodes(const ExprAST *E, unsigned Limit) {
+  unsigned Count = 1;
+  forEachChild(E, [&](const ExprAST *Sub) {
+    if (Count <= Limit)
+      Count += countNodes(Sub, Limit - Count);
+  });
+  return Count;
+}
+
+std::shared_ptr<FuncAST> restoreDefinition(Symbol Name,
+                                           std::shared_ptr<FuncAST> Def) {
+  std::lock_guard<std::mutex> Guard(TheEngine->DefinitionsMutex);
+  auto &Definitions = TheEngine->Definitions;
+  if (Name.id() >= Definitions.size())
+    Definitions.resize(Name.id() + 1);
+  std::swap(Definitions[Name.id()], Def);
+  return Def;
+}
+
+std::shared_ptr<FuncAST> retainDefinition(std::shared_ptr<FuncAST> Def) {
+  auto Budget = TheEngine->InlineBudget;
+  bool Retain = TheEngine->RetainDefinitions || TheEngine->Memoize ||
+                (Budget && countNodes(Def->body, Budget) <= Budget);
+  auto Name = Def->proto.name;
+  // A dropped definition still replaces an earlier one, which must no longer
+  // be inlined.
+  return restoreDefinition(Name, Retain ? std::move(Def) : nullptr);
+}
+
+std::shared_ptr<FuncAST> getDefinition(Symbol Name) {
+  std::lock_guard<std::mutex> Guard(TheEngine->DefinitionsMutex);
+  auto &Definitions = TheEngine->Definitions;
+  if (Name.id() >= Definitions.size())
+    return nullptr;
+  return Definitions[Name.id()];
+}
+
+// Whether E has a pfor or calls Name.
+static bool hasPForOrCall(const ExprAST *E, Symbol Name) {
+  if (isa<PForExprAST>(E))
+    return true;
+  if (auto Call = dyn_cast<CallExprAST>(E); Call && Call->callee == Name)
+    return true;
+  bool Found = false;
+  forEachChild(E,
+               [&](const ExprAST *Sub) { Found |= hasPForOrCall(Sub, Name); });
+  return Found;
+}
+
+static bool isImportable(const FuncAST &Def, const Function &Decl) {
+  auto Budget = TheEngine->InlineBudget;
+  if (Def.proto.parameters.size() != Decl.arg_size() ||
+      countNodes(Def.body, Budget) > Budget ||
+      hasPForOrCall(Def.body, Def.proto.name))
+    return false;
+  // A memoized def must keep its table.
+  return !TheEngine->Memoize || !shouldMemoize(Def);
+}
+
+SmallVector<std::shared_ptr<FuncAST>, 4> importCallees() {
+  SmallVector<std::shared_ptr<FuncAST>, 4> Imported;
+  if (!TheEngine->InlineBudget)
+    return Imported;
+  std::vector<Function *> Declarations;
+  for (auto &F : *TheModule)
+    if (F.isDeclaration() && !F.isIntrinsic())
+      Declarations.push_back(&F);
+  while (!Declarations.empty()) {
+    auto F = Declarations.back();
+    Declarations.pop_back();
+    auto Name = Symbols.intern(F->getName());
+    auto Def = getDefinition(Name);
+    if (!Def || !isImportable(*Def, *F))
+      continue;
+    auto Size = TheModule->size();
+    Def->codegen(/*Optimize=*/false);
+    F->setLinkage(GlobalValue::AvailableExternallyLinkage);
+    Imported.push_back(std::move(Def));
+    // The body may have declared further callees.
+    for (auto &G : make_range(std::next(TheModule->begin(), Size),
+                              TheModule->end()))
+      if (G.isDeclaration())
+        Declarations.push_back(&G);
+  }
+  return Imported;
+}
+
+// Compiles every retained definition that TheModule only declares, until the
+// module is closed under calls to retained definitions.
+static void addCallees() {
+  std::vector<Function *> Declarations;
+  bool Changed = true;
+  while (Changed) {
+    Changed = false;
+    Declarations.clear();
+    for (auto &F : *TheModule)
+      if (F.isDeclaration())
+        Declarations.push_back(&F);
+    for (auto F : Declarations)
+      if (auto Def = getDefinition(Symbols.intern(F->getName()))) {
+        Def->codegen(/*Optimize=*/false);
+        Changed = true;
+      }
+  }
+}
+
+// Emits `void Name(ptr Columns, ptr noalias Out, i64 Rows)` looping over the
+// rows and calling F on each.
+static void buildDriver(Function *F, StringRef Name) {
+  auto &Ctx = *TheContext;
+  auto PtrTy = PointerType::getUnqual(Ctx);
+  auto Int64Ty = Type::getInt64Ty(Ctx);
+  auto DoubleTy = Type::getDoubleTy(Ctx);
+  auto Driver = Function::Create(
+      FunctionType::get(Type::getVoidTy(Ctx), {PtrTy, PtrTy, Int64Ty}, false),
+      Function::ExternalLinkage, Name, TheModule.get());
+  auto Columns = Driver->getArg(0);
+  auto Out = Driver->getArg(1);
+  auto Rows = Driver->getArg(2);
+  Out->addAttr(Attribute::NoAlias);
+
+  auto Entry = BasicBlock::Create(Ctx, "entry", Driver);
+  auto Loop = BasicBlock::Create(Ctx, "loop", Driver);
+  auto Exit = BasicBlock::Create(Ctx, "exit", Driver);
+  IRBuilder<> B(Entry);
+  std::vector<Value *> Cols;
+  for (unsigned I = 0; I < F->arg_size(); ++I)
+    Cols.push_back(
+        B.CreateLoad(PtrTy, B.CreateConstInBoundsGEP1_64(PtrTy, Columns, I)));
+  B.CreateCondBr(B.CreateICmpEQ(Rows, B.getInt64(0)), Exit, Loop);
+
+  B.SetInsertPoint(Loop);
+  auto Row = B.CreatePHI(Int64Ty, 2);
+  Row->addIncoming(B.getInt64(0), Entry);
+  std::vector<Value *> Args;
+  for (auto Col : Cols)
+    Args.push_back(
+        B.CreateLoad(DoubleTy, B.CreateInBoundsGEP(DoubleTy, Col, Row)));
+  B.CreateStore(B.CreateCall(F, Args),
+                B.CreateInBoundsGEP(DoubleTy, Out, Row));
+  auto Next = B.CreateAdd(Row, B.getInt64(1), "", /*HasNUW=*/true);
+  Row->addIncoming(Next, Loop);
+  B.CreateCondBr(B.CreateICmpEQ(Next, Rows), Exit, Loop);
+
+  B.SetInsertPoint(Exit);
+  B.CreateRetVoid();
+  verifyFunction(*Driver);
+}
+
+Expected<MapFunction> compileMap(Symbol Name) {
+  if (!TheEngine->RetainDefinitions)
+    return createStringError(inconvertibleErrorCode(),
+                             "mapping needs the engine to retain definitions");
+  auto Def = getDefinition(Name);
+  if (!Def)
+    return createStringError(inconvertibleErrorCode(),
+                             "no definition of '%s' to map",
+                             Name.str().str().c_str());
+  if (!Def->proto.isAllF64())
+    return createStringError(inconvertibleErrorCode(),
+                             "'%s' must take and return f64 to be mapped",
+                             Name.str().str().c_str());
+  static std::atomic<unsigned> Count;
+  auto DriverName = (Name.str() + "$map." + Twine(Count++)).str();
+  // Build the driver on its own thread, which gets a fresh set of thread-local
+  // codegen state and leaves the caller's current module alone.
+  auto &Engine = *TheEngine;
+  return std::async(std::launch::async, [&]() -> Expected<MapFunction> {
+           EngineScope Scope(Engine);
+           InitializeModuleAndManagers();
+           auto F = Def->codegen(/*Optimize=*/false);
+           addCallees();
+           for (auto &G : *TheModule)
+             if (!G.isDeclaration())
+               G.setLinkage(GlobalValue::InternalLinkage);
+           buildDriver(F, DriverName);
+           {
+             TimeTraceScope Trace("Optimize", DriverName);
+             OptimizeModule(*TheModule, OptimizationLevel::O3);
+           }
+           if (auto Err = Engine.JIT->addModule(TakeModule()))
+             return Err;
+           TimeTraceScope Trace("Materialize", DriverName);
+           auto Sym = Engine.JIT->lookup(DriverName);
+           if (!Sym)
+             return Sym.takeError();
+           return Sym->getAddress().toPtr<MapFunction>();
+         })
+      .get();
+}
@@ -0,0 +1,209 @@
+#include "memo.h"
+#include "jit.h"
+#include "map.h"
+
+#include <cstring>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/MapVector.h>
+#include <mutex>
+
+using namespace llvm;
+
+MemoTable::MemoTable(std::string Name, unsigned Arity, unsigned Size)
+    : Name(std::move(Name)), Arity(Arity),
+      Mask(PowerOf2Ceil(std::max(Size, 1u)) - 1),
+      Entries(new std::atomic<uint64_t>[(Mask + 1) * (2 + Arity)]()) {}
+
+static uint64_t toBits(double X) {
+  uint64_t Bits;
+  std::memcpy(&Bits, &X, sizeof(Bits));
+  return Bits;
+}
+
+static double fromBits(uint64_t Bits) {
+  double X;
+  std::memcpy(&X, &Bits, sizeof(X));
+  return X;
+}
+
+std::atomic<uint64_t> *MemoTable::getEntry(const double *Args) {
+  uint64_t H = Arity;
+  for (unsigned I = 0; I < Arity; ++I)
+    H = (H ^ toBits(Args[I])) * 0x9e3779b97f4a7c15;
+  // Small integers differ in the high bits of their pattern only.
+  H ^= H >> 33;
+  H *= 0xff51afd7ed558ccd;
+  H ^= H >> 33;
+  return &Entries[(H & Mask) * (2 + Arity)];
+}
+
+// An entry's sequence number is odd while it is written and 0 while it is
+// empty. A lookup that sees it change read a torn entry and misses.
+bool MemoTable::lookup(const double *Args, double &Value) {
+  auto E = getEntry(Args);
+  auto Seq = E[0].load(std::memory_order_acquire);
+  bool Hit = Seq && !(Seq & 1);
+  auto Bits = E[1].load(std::memory_order_relaxed);
+  for (unsigned I = 0; I < Arity; ++I)
+    Hit &= E[2 + I].load(std::memory_order_relaxed) == toBits(Args[I]);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  Hit &= E[0].load(std::memory_order_relaxed) == Seq;
+  (Hit ? Hits : Misses).fetch_add(1, std::memory_order_relaxed);
+  if (Hit)
+    Value = fromBits(Bits);
+  return Hit;
+}
+
+void MemoTable::store(const double *Args, double Value) {
+  auto E = getEntry(Args);
+  auto Seq = E[0].load(std::memory_order_relaxed);
+  if ((Seq & 1) ||
+      !E[0].compare_exchange_strong(Seq, Seq + 1, std::memory_order_acquire,
+                                    std::memory_order_relaxed))
+    return;
+  std::atomic_thread_fence(std::memory_order_release);
+  E[1].store(toBits(Value), std::memory_order_relaxed);
+  for (unsigned I = 0; I < Arity; ++I)
+    E[2 + I].store(toBits(Args[I]), std::memory_order_relaxed);
+  E[0].store(Seq + 2, std::memory_order_release);
+}
+
+extern "C" int32_t kale_memo_lookup(MemoTable *Table, const double *Args,
+                                    double *Value) {
+  return Table->lookup(Args, *Value);
+}
+
+extern "C" void kale_memo_store(MemoTable *Table, const double *Args,
+                                double Value) {
+  Table->store(Args, Value);
+}
+
+// Calls F on the callee of every call in E.
+static void forEachCallee(const ExprAST *E, function_ref<void(Symbol)> F) {
+  if (auto Call = dyn_cast<CallExprAST>(E))
+    F(Call->callee);
+  forEachChild(E, [&](const ExprAST *Sub) { forEachCallee(Sub, F); });
+}
+
+bool shouldMemoize(const FuncAST &Def, SmallVectorImpl<Symbol> *Callees) {
+  // The tables hold doubles.
+  if (!Def.proto.isAllF64())
+    return false;
+  auto Name = Def.proto.name;
+  bool Recursive = false;
+  DenseSet<uint32_t> Seen;
+  SmallVector<Symbol, 8> Worklist;
+  auto Visit = [&](const FuncAST &F) {
+    forEachCallee(F.body, [&](Symbol Callee) {
+      if (Callee == Name)
+        Recursive = true;
+      else if (Seen.insert(Callee.id()).second)
+        Worklist.push_back(Callee);
+    });
+  };
+  Visit(Def);
+  while (!Worklist.empty()) {
+    auto Callee = Worklist.pop_back_val();
+    auto CalleeDef = getDefinition(Callee);
+    if (!CalleeDef)
+      return false;
+    if (Callees)
+      Callees->push_back(Callee);
+    Visit(*CalleeDef);
+  }
+  return Recursive;
+}
+
+void memoize(Function *F, Symbol Name, ArrayRef<Symbol> Callees) {
+  auto &Ctx = F->getContext();
+  auto M = F->getParent();
+  unsigned Arity = F->arg_size();
+  auto Body = Function::Create(F->getFunctionType(),
+                               Function::InternalLinkage,
+                               F->getName() + ".body", M);
+  Body->splice(Body->begin(), F);
+  for (unsigned I = 0; I < Arity; ++I) {
+    Body->getArg(I)->takeName(F->getArg(I));
+    F->getArg(I)->replaceAllUsesWith(Body->getArg(I));
+  }
+
+  MemoTable *Table;
+  {
+    std::lock_guard<std::mutex> Guard(TheEngine->MemoMutex);
+    Table = TheEngine->MemoTables
+                .emplace_back(std::make_unique<MemoTable>(
+                    F->getName().str(), Arity, TheEngine->MemoSize))
+                .get();
+    auto &Dependents = TheEngine->MemoDependents;
+    for (auto Callee : Callees) {
+      if (Callee.id() >= Dependents.size())
+        Dependents.resize(Callee.id() + 1);
+      if (!is_contained(Dependents[Callee.id()], Name))
+        Dependents[Callee.id()].push_back(Name);
+    }
+  }
+
+  auto DoubleTy = Type::getDoubleTy(Ctx);
+  auto PtrTy = PointerType::getUnqual(Ctx);
+  auto Lookup = M->getOrInsertFunction("kale_memo_lookup",
+                                       Type::getInt32Ty(Ctx), PtrTy, PtrTy,
+                                       PtrTy);
+  auto Store = M->getOrInsertFunction("kale_memo_store",
+                                      Type::getVoidTy(Ctx), PtrTy, PtrTy,
+                                      DoubleTy);
+  IRBuilder<> B(BasicBlock::Create(Ctx, "entry", F));
+  auto TablePtr = ConstantExpr::getIntToPtr(
+      B.getInt64(reinterpret_cast<uintptr_t>(Table)), PtrTy);
+  auto Args = B.CreateAlloca(ArrayType::get(DoubleTy, std::max(Arity, 1u)),
+                             nullptr, "args");
+  auto Result = B.CreateAlloca(DoubleTy, nullptr, "result");
+  SmallVector<Value *, 8> Params;
+  for (unsigned I = 0; I < Arity; ++I) {
+    Params.push_back(F->getArg(I));
+    B.CreateStore(F->getArg(I), B.CreateConstGEP2_32(Args->getAllocatedType(),
+                                                     Args, 0, I));
+  }
+  auto Hit = BasicBlock::Create(Ctx, "hit", F);
+  auto Miss = BasicBlock::Create(Ctx, "miss", F);
+  B.CreateCondBr(
+      B.CreateICmpNE(B.CreateCall(Lookup, {TablePtr, Args, Result}),
+                     B.getInt32(0)),
+      Hit, Miss);
+  B.SetInsertPoint(Hit);
+  B.CreateRet(B.CreateLoad(DoubleTy, Result));
+  B.SetInsertPoint(Miss);
+  auto Computed = B.CreateCall(Body, Params);
+  B.CreateCall(Store, {TablePtr, Args, Computed});
+  B.CreateRet(Computed);
+  verifyFunction(*F);
+}
+
+std::vector<Symbol> takeMemoDependents(Symbol Name) {
+  std::lock_guard<std::mutex> Guard(TheEngine->MemoMutex);
+  auto &Dependents = TheEngine->MemoDependents;
+  if (Name.id() >= Dependents.size())
+    return {};
+  return std::move(Dependents[Name.id()]);
+}
+
+void printMemoStats(raw_ostream &OS) {
+  std::lock_guard<std::mutex> Guard(TheEngine->MemoMutex);
+  if (TheEngine->MemoTables.empty())
+    return;
+  // Recompilations of a def get tables of their own; report them together.
+  MapVector<StringRef, std::pair<uint64_t, uint64_t>> Totals;
+  for (auto &Table : TheEngine->MemoTables) {
+    auto &[Hits, Lookups] = Totals[Table->Name];
+    auto TableHits = Table->Hits.load(std::memory_order_relaxed);
+    Hits += TableHits;
+    Lookups += TableHits + Table->Misses.load(std::memory_order_relaxed);
+  }
+  OS << "Memo:    Lookups       Hits  Hit rate  Function\n";
+  for (auto &[Name, Counts] : Totals) {
+    auto [Hits, Lookups] = Counts;
+    OS << format("     %10llu %10llu   %6.2f%%  ", (unsigned long long)Lookups,
+                 (unsigned long long)Hits,
+                 Lookups ? 100.0 * Hits / Lookups : 0.0)
+       << Name << "\n";
+  }
+}
@@ -0,0 +1,171 @@
+#include "pfor.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <llvm/Support/Threading.h>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// One running pfor. Its chunks are split into one contiguous range per slot.
+// Every participant takes chunks from the front of its own range and, once
+// that is empty, steals them from the back of the other ranges.
+struct Loop {
+  PForChunk Chunk;
+  const double *Env;
+  int64_t Begin;
+  int64_t End;
+  uint64_t Size;
+  unsigned Slots;
+  // Per slot, the next chunk in the low and the end of the range in the high
+  // 32 bits, so that owner and thieves agree through a single CAS.
+  std::unique_ptr<std::atomic<uint64_t>[]> Ranges;
+  std::vector<double> Partials;
+  std::atomic<uint64_t> Remaining;
+  // Guarded by the pool mutex.
+  unsigned Helpers = 0;
+  unsigned NextSlot = 1;
+
+  Loop(PForChunk Chunk, const double *Env, int64_t Begin, int64_t End,
+       uint64_t Size, uint64_t Count, unsigned Slots)
+      : Chunk(Chunk), Env(Env), Begin(Begin), End(End), Size(Size),
+        Slots(Slots), Ranges(new std::atomic<uint64_t>[Slots]),
+        Partials(Count), Remaining(Count) {
+    for (unsigned S = 0; S < Slots; ++S)
+      Ranges[S] = (Count * (S + 1) / Slots) << 32 | Count * S / Slots;
+  }
+
+  bool take(unsigned Slot, uint64_t &Index) {
+    for (unsigned I = 0; I < Slots; ++I) {
+      auto &Range = Ranges[(Slot + I) % Slots];
+      auto Cur = Range.load(std::memory_order_relaxed);
+      while (true) {
+        uint64_t Lo = uint32_t(Cur), Hi = Cur >> 32;
+        if (Lo >= Hi)
+          break;
+        auto New = I == 0 ? Hi << 32 | (Lo + 1) : (Hi - 1) << 32 | Lo;
+        if (Range.compare_exchange_weak(Cur, New,
+                                        std::memory_order_relaxed)) {
+          Index = I == 0 ? Lo : Hi - 1;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Runs chunks until none is left to take.
+  void run(unsigned Slot) {
+    uint64_t Index;
+    while (take(Slot, Index)) {
+      int64_t B = Begin + int64_t(Index * Size);
+      int64_t E = B + int64_t(std::min(uint64_t(End) - uint64_t(B), Size));
+      Partials[Index] = Chunk(Env, B, E);
+      if (Remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        Remaining.notify_all();
+    }
+  }
+};
+
+// The process-wide workers. The thread calling kale_pfor works on its loop
+// as well, so a loop makes progress even when every worker is busy with an
+// outer one.
+class Pool {
+  std::mutex Mutex;
+  std::condition_variable Wake;
+  std::condition_variable Left;
+  // Loops that may still have chunks to take, innermost last.
+  std::vector<Loop *> Loops;
+  std::vector<std::thread> Workers;
+  bool Stop = false;
+
+  void work() {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    while (true) {
+      Wake.wait(Lock, [&] { return Stop || !Loops.empty(); });
+      if (Stop)
+        return;
+      auto L = Loops.back();
+      unsigned Slot = L->NextSlot++ % L->Slots;
+      ++L->Helpers;
+      Lock.unlock();
+      L->run(Slot);
+      Lock.lock();
+      // Every chunk has been taken, so stop offering the loop.
+      std::erase(Loops, L);
+      if (--L->Helpers == 0)
+        Left.notify_all();
+    }
+  }
+
+public:
+  Pool() {
+    unsigned N = llvm::hardware_concurrency().compute_thread_count();
+    for (unsigned I = 1; I < N; ++I)
+      Workers.emplace_back([this] { work(); });
+  }
+
+  ~Pool() {
+    {
+      std::lock_guard<std::mutex> Guard(Mutex);
+      Stop = true;
+    }
+    Wake.notify_all();
+    for (auto &T : Workers)
+      T.join();
+  }
+
+  unsigned size() const { return Workers.size() + 1; }
+
+  void run(Loop &L) {
+    {
+      std::lock_guard<std::mutex> Guard(Mutex);
+      Loops.push_back(&L);
+    }
+    Wake.notify_all();
+    L.run(0);
+    for (auto N = L.Remaining.load(std::memory_order_acquire); N;
+         N = L.Remaining.load(std::memory_order_acquire))
+      L.Remaining.wait(N, std::memory_order_acquire);
+    // Helpers may still be on their way out of L.run().
+    std::unique_lock<std::mutex> Lock(Mutex);
+    std::erase(Loops, &L);
+    Left.wait(Lock, [&] { return L.Helpers == 0; });
+  }
+};
+
+} // namespace
+
+extern "C" double kale_pfor(PForChunk Chunk, const double *Env, int64_t Begin,
+                            int64_t End, int64_t ChunkSize, int32_t Reduce) {
+  double Result = Reduce == '*' ? 1.0 : 0.0;
+  if (Begin >= End)
+    return Result;
+  static Pool ThePool;
+  uint64_t Trips = uint64_t(End) - uint64_t(Begin);
+  uint64_t Size = ChunkSize > 0
+                      ? ChunkSize
+                      : std::max<uint64_t>(Trips / (ThePool.size() * 8), 1);
+  // Chunk indices must fit in 32 bits.
+  Size = std::max(Size, Trips / UINT32_MAX + 1);
+  uint64_t Count = (Trips - 1) / Size + 1;
+
+  Loop L(Chunk, Env, Begin, End, Size, Count,
+         std::min<uint64_t>(ThePool.size(), Count));
+  if (L.Slots == 1)
+    L.run(0);
+  else
+    ThePool.run(L);
+
+  // Combining the partial results in chunk order makes the result independent
+  // of the schedule for a given chunk size.
+  if (!Reduce)
+    return 0.0;
+  for (auto P : L.Partials)
+    Result = Reduce == '*' ? Result * P : Result + P;
+  return Result;
+}
@@ -0,0 +1,217 @@
+#include "profile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <dlfcn.h>
+#include <llvm/Demangle/Demangle.h>
+#include <llvm/Object/SymbolSize.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+using namespace llvm;
+
+// Calls F(Name, Address, Size) for every function of a loaded object.
+static void
+forEachFunction(const object::ObjectFile &Obj,
+                const RuntimeDyld::LoadedObjectInfo &L,
+                function_ref<void(StringRef, uint64_t, uint64_t)> F) {
+  // The debug object carries the load addresses of the symbols.
+  auto DebugObj = L.getObjectForDebug(Obj);
+  auto &Loaded = DebugObj.getBinary() ? *DebugObj.getBinary() : Obj;
+  for (auto [Sym, Size] : object::computeSymbolSizes(Loaded)) {
+    auto Type = Sym.getType();
+    auto Name = Sym.getName();
+    auto Addr = Sym.getAddress();
+    if (!Type || !Name || !Addr || *Type != object::SymbolRef::ST_Function) {
+      consumeError(Type.takeError());
+      consumeError(Name.takeError());
+      consumeError(Addr.takeError());
+      continue;
+    }
+    if (Size)
+      F(*Name, *Addr, Size);
+  }
+}
+
+PerfMapListener &PerfMapListener::get() {
+  static PerfMapListener Listener;
+  return Listener;
+}
+
+void PerfMapListener::notifyObjectLoaded(
+    ObjectKey, const object::ObjectFile &Obj,
+    const RuntimeDyld::LoadedObjectInfo &L) {
+  std::lock_guard<std::mutex> Guard(Mutex);
+  if (!Out) {
+    std::error_code EC;
+    auto Path = ("/tmp/perf-" + Twine(getpid()) + ".map").str();
+    Out = std::make_unique<raw_fd_ostream>(Path, EC, sys::fs::OF_Text);
+    if (EC) {
+      errs() << "kale: cannot write " << Path << ": " << EC.message() << "\n";
+      return;
+    }
+  }
+  if (Out->has_error())
+    return;
+  forEachFunction(Obj, L, [&](StringRef Name, uint64_t Addr, uint64_t Size) {
+    *Out << format_hex_no_prefix(Addr, 1) << ' '
+         << format_hex_no_prefix(Size, 1) << ' ' << Name << '\n';
+  });
+  // perf reads the map after the process has gone, possibly abnormally.
+  Out->flush();
+}
+
+// The samples not attributed yet, in a ring written by the signal handler.
+// A zero slot is free.
+static constexpr uint64_t SampleCapacity = 1 << 16;
+static std::atomic<uintptr_t> Samples[SampleCapacity];
+static std::atomic<uint64_t> SampleHead;
+static std::atomic<uint64_t> SamplesDropped;
+static uint64_t SampleTail;
+
+static uintptr_t getPC(void *Context) {
+  auto UC = static_cast<ucontext_t *>(Context);
+#if defined(__x86_64__)
+  return UC->uc_mcontext.gregs[REG_RIP];
+#elif defined(__aarch64__)
+  return UC->uc_mcontext.pc;
+#else
+  (void)UC;
+  return 0;
+#endif
+}
+
+static void onSIGPROF(int, siginfo_t *, void *Context) {
+  uintptr_t PC = getPC(Context);
+  if (!PC)
+    return;
+  auto &Slot = Samples[SampleHead.fetch_add(1, std::memory_order_relaxed) %
+                       SampleCapacity];
+  uintptr_t Free = 0;
+  if (!Slot.compare_exchange_strong(Free, PC, std::memory_order_release,
+                                    std::memory_order_relaxed))
+    SamplesDropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+SamplingProfiler &SamplingProfiler::get() {
+  static SamplingProfiler Profiler;
+  return Profiler;
+}
+
+Error SamplingProfiler::start(unsigned Rate) {
+  std::lock_guard<std::mutex> Guard(Mutex);
+  if (Running)
+    return Error::success();
+  struct sigaction Action = {};
+  Action.sa_sigaction = onSIGPROF;
+  Action.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&Action.sa_mask);
+  if (sigaction(SIGPROF, &Action, nullptr))
+    return errorCodeToError(std::error_code(errno, std::generic_category()));
+  Rate = std::clamp(Rate, 1u, 1000000u);
+  struct itimerval Timer = {};
+  // tv_usec must stay below a second.
+  unsigned Interval = 1000000 / Rate;
+  Timer.it_interval.tv_sec = Interval / 1000000;
+  Timer.it_interval.tv_usec = Interval % 1000000;
+  Timer.it_value = Timer.it_interval;
+  if (setitimer(ITIMER_PROF, &Timer, nullptr))
+    return errorCodeToError(std::error_code(errno, std::generic_category()));
+  Frequency = Rate;
+  Running = true;
+  Drainer = std::thread([this] {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    while (!Wake.wait_for(Lock, std::chrono::milliseconds(100),
+                          [&] { return !Running; }))
+      drain();
+  });
+  return Error::success();
+}
+
+void SamplingProfiler::stop() {
+  {
+    std::lock_guard<std::mutex> Guard(Mutex);
+    if (!Running)
+      return;
+    struct itimerval Timer = {};
+    setitimer(ITIMER_PROF, &Timer, nullptr);
+    // A signal still pending is ignored rather than killing the process.
+    signal(SIGPROF, SIG_IGN);
+    Running = false;
+    drain();
+  }
+  Wake.notify_all();
+  Drainer.join();
+}
+
+void SamplingProfiler::drain() {
+  auto Head = SampleHead.load(std::memory_order_relaxed);
+  for (; SampleTail < Head; ++SampleTail) {
+    auto PC = Samples[SampleTail % SampleCapacity].exchange(
+        0, std::memory_order_acquire);
+    if (!PC)
+      continue;
+    ++Attributed;
+    auto I = Functions.upper_bound(PC);
+    if (I != Functions.begin() && PC < std::prev(I)->second.End) {
+      ++Counts[std::prev(I)->second.Name];
+      continue;
+    }
+    Dl_info Info;
+    if (dladdr(reinterpret_cast<void *>(PC), &Info) && Info.dli_sname)
+      ++Counts["[host] " + demangle(Info.dli_sname)];
+    else
+      ++Counts["[unknown]"];
+  }
+}
+
+void SamplingProfiler::report(raw_ostream &OS, unsigned Top) {
+  std::lock_guard<std::mutex> Guard(Mutex);
+  drain();
+  std::vector<std::pair<uint64_t, StringRef>> Sorted;
+  for (auto &Entry : Counts)
+    Sorted.push_back({Entry.second, Entry.first()});
+  llvm::sort(Sorted, [](auto &A, auto &B) {
+    return A.first != B.first ? A.first > B.first : A.second < B.second;
+  });
+  OS << "Profile: " << Attributed << " samples";
+  if (Frequency)
+    OS << " at " << Frequency << " Hz";
+  if (auto Dropped = SamplesDropped.load())
+    OS << ", " << Dropped << " dropped";
+  OS << "\n";
+  if (Sorted.empty())
+    return;
+  if (Sorted.size() > Top)
+    Sorted.resize(Top);
+  OS << "  Samples       %  Function\n";
+  for (auto &[Count, Name] : Sorted)
+    OS << format("%9llu  %6.2f  ", (unsigned long long)Count,
+                 100.0 * Count / Attributed)
+       << Name << "\n";
+}
+
+void SamplingProfiler::notifyObjectLoaded(
+    ObjectKey K, const object::ObjectFile &Obj,
+    const RuntimeDyld::LoadedObjectInfo &L) {
+  std::lock_guard<std::mutex> Guard(Mutex);
+  forEachFunction(Obj, L, [&](StringRef Name, uint64_t Addr, uint64_t Size) {
+    Functions[Addr] = {Addr + Size, Name.str()};
+    Objects[K].push_back(Addr);
+  });
+}
+
+void SamplingProfiler::notifyFreeingObject(ObjectKey K) {
+  std::lock_guard<std::mutex> Guard(Mutex);
+  // Samples in the object's code must be attributed before it is reused.
+  drain();
+  auto I = Objects.find(K);
+  if (I == Objects.end())
+    return;
+  for (auto Addr : I->second)
+    Functions.erase(Addr);
+  Objects.erase(I);
+}
@@ -0,0 +1,243 @@
+#include "stream.h"
+#include "pfor.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <sys/mman.h>
+#include <vector>
+
+using namespace llvm;
+
+static Expected<std::unique_ptr<MemoryBuffer>> mapInput(StringRef Path) {
+  auto Buf = MemoryBuffer::getFile(Path, /*IsText=*/false,
+                                   /*RequiresNullTerminator=*/false);
+  if (!Buf)
+    return createFileError(Path, Buf.getError());
+  // Tell the kernel that the file is read once, front to back, so that it
+  // reads ahead and drops the pages behind.
+  auto Start = const_cast<char *>((*Buf)->getBufferStart());
+  if (reinterpret_cast<uintptr_t>(Start) %
+          sys::Process::getPageSizeEstimate() ==
+      0)
+    posix_madvise(Start, (*Buf)->getBufferSize(), POSIX_MADV_SEQUENTIAL);
+  return std::move(*Buf);
+}
+
+namespace {
+// A window of columnar input. The kale_pfor iterations are its rows.
+struct ColumnWindow {
+  MapFunction Map;
+  const double *const *Columns;
+  double *Out;
+};
+
+// A run of whole lines of CSV, parsed and mapped by one kale_pfor iteration.
+struct CSVChunk {
+  const char *Begin = nullptr;
+  const char *End = nullptr;
+  // Column-major, Stride values per column.
+  std::vector<double> Values;
+  std::vector<double> Results;
+  // The first malformed line, if any.
+  const char *Error = nullptr;
+};
+
+// A window of CSV input. The kale_pfor iterations are its chunks.
+struct CSVWindow {
+  MapFunction Map;
+  unsigned Arity;
+  CSVChunk *Chunks;
+};
+} // namespace
+
+// The chunk function of a window of columns; Env points to the window.
+static double mapRows(const double *Env, int64_t Begin, int64_t End) {
+  auto &W = *reinterpret_cast<const ColumnWindow *>(Env);
+  SmallVector<const double *, 8> Columns;
+  for (unsigned I = 0; W.Columns[I]; ++I)
+    Columns.push_back(W.Columns[I] + Begin);
+  W.Map(Columns.data(), W.Out + Begin, End - Begin);
+  return 0;
+}
+
+Expected<StreamStats> streamColumns(MapFunction Map,
+                                    ArrayRef<std::string> Inputs,
+                                    StringRef Output,
+                                    const StreamOptions &Opts) {
+  StreamStats Stats;
+  std::vector<std::unique_ptr<MemoryBuffer>> Files;
+  for (auto &Path : Inputs) {
+    auto Buf = mapInput(Path);
+    if (!Buf)
+      return Buf.takeError();
+    auto Size = (*Buf)->getBufferSize();
+    if (Size % sizeof(double))
+      return createStringError(inconvertibleErrorCode(),
+                               "%s is not a column of doubles", Path.c_str());
+    if (!Files.empty() && Size / sizeof(double) != Stats.Rows)
+      return createStringError(inconvertibleErrorCode(),
+                               "%s does not have %llu rows", Path.c_str(),
+                               (unsigned long long)Stats.Rows);
+    Stats.Rows = Size / sizeof(double);
+    Stats.BytesIn += Size;
+    Files.push_back(std::move(*Buf));
+  }
+  std::error_code EC;
+  ToolOutputFile Out(Output, EC, sys::fs::OF_None);
+  if (EC)
+    return createFileError(Output, EC);
+
+  uint64_t RowBytes = (Files.size() + 1) * sizeof(double);
+  uint64_t ChunkRows = std::max<uint64_t>(Opts.ChunkBytes / RowBytes, 1);
+  uint64_t WindowRows =
+      std::max(Opts.WindowBytes / RowBytes / ChunkRows, uint64_t(1)) *
+      ChunkRows;
+  std::vector<double> Results(std::min(WindowRows, Stats.Rows));
+  // Null-terminated, so that chunks need not be told the arity.
+  std::vector<const double *> Columns(Files.size() + 1);
+  ColumnWindow W = {Map, Columns.data(), Results.data()};
+  for (uint64_t Row = 0; Row < Stats.Rows; Row += WindowRows) {
+    uint64_t Rows = std::min(WindowRows, Stats.Rows - Row);
+    for (size_t I = 0; I < Files.size(); ++I)
+      Columns[I] =
+          reinterpret_cast<const double *>(Files[I]->getBufferStart()) + Row;
+    kale_pfor(mapRows, reinterpret_cast<const double *>(&W), 0, Rows,
+              ChunkRows, 0);
+    Out.os().write(reinterpret_cast<const char *>(Results.data()),
+                   Rows * sizeof(double));
+  }
+  Out.os().close();
+  if (Out.os().has_error())
+    return createFileError(Output, Out.os().error());
+  Out.keep();
+  Stats.BytesOut = Stats.Rows * sizeof(double);
+  return Stats;
+}
+
+// Returns the start of the line after the one containing P, or End.
+static const char *nextLine(const char *P, const char *End) {
+  auto NL = static_cast<const char *>(std::memchr(P, '\n', End - P));
+  return NL ? NL + 1 : End;
+}
+
+static const char *skipSpaces(const char *P, const char *End) {
+  while (P != End && (*P == ' ' || *P == '\t' || *P == '\r'))
+    ++P;
+  return P;
+}
+
+// Parses the line [P, End) of Arity comma-separated numbers into Fields[0],
+// Fields[Stride], and so on. Fails if the line is malformed.
+static bool parseLine(const char *P, const char *End, unsigned Arity,
+                      double *Fields, uint64_t Stride) {
+  for (unsigned I = 0; I < Arity; ++I) {
+    if (I && (P == End || *P++ != ','))
+      return false;
+    P = skipSpaces(P, End);
+    if (P != End && *P == '+')
+      ++P;
+    auto [Next, EC] = std::from_chars(P, End, Fields[I * Stride]);
+    if (EC != std::errc())
+      return false;
+    P = skipSpaces(Next, End);
+  }
+  return P == End;
+}
+
+// The chunk function of a window of CSV; Env points to the window.
+static double mapLines(const double *Env, int64_t Begin, int64_t End) {
+  auto &W = *reinterpret_cast<const CSVWindow *>(Env);
+  for (auto I = Begin; I < End; ++I) {
+    auto &C = W.Chunks[I];
+    // Every line but blank ones is a row.
+    uint64_t Stride = std::count(C.Begin, C.End, '\n') + 1;
+    C.Values.resize(Stride * W.Arity);
+    C.Results.clear();
+    C.Error = nullptr;
+    uint64_t Rows = 0;
+    for (auto Line = C.Begin; Line < C.End;) {
+      auto Next = nextLine(Line, C.End);
+      auto LineEnd = Next[-1] == '\n' ? Next - 1 : Next;
+      if (skipSpaces(Line, LineEnd) != LineEnd) {
+        if (!parseLine(Line, LineEnd, W.Arity, C.Values.data() + Rows,
+                       Stride)) {
+          C.Error = Line;
+          break;
+        }
+        ++Rows;
+      }
+      Line = Next;
+    }
+    if (C.Error)
+      continue;
+    SmallVector<const double *, 8> Columns;
+    for (unsigned J = 0; J < W.Arity; ++J)
+      Columns.push_back(C.Values.data() + J * Stride);
+    C.Results.resize(Rows);
+    W.Map(Columns.data(), C.Results.data(), Rows);
+  }
+  return 0;
+}
+
+Expected<StreamStats> streamCSV(MapFunction Map, unsigned Arity,
+                                StringRef Input, StringRef Output,
+                                const StreamOptions &Opts) {
+  auto Buf = mapInput(Input);
+  if (!Buf)
+    return Buf.takeError();
+  const char *Start = (*Buf)->getBufferStart();
+  const char *End = (*Buf)->getBufferEnd();
+  StreamStats Stats;
+  Stats.BytesIn = End - Start;
+  std::error_code EC;
+  ToolOutputFile Out(Output, EC, sys::fs::OF_None);
+  if (EC)
+    return createFileError(Output, EC);
+
+  auto Pos = Start;
+  if (Pos < End) {
+    auto Next = nextLine(Pos, End);
+    auto LineEnd = Next[-1] == '\n' ? Next - 1 : Next;
+    std::vector<double> Fields(Arity);
+    if (!parseLine(Pos, LineEnd, Arity, Fields.data(), 1))
+      Pos = Next;
+  }
+  uint64_t ChunkBytes = std::max<uint64_t>(Opts.ChunkBytes, 1);
+  uint64_t WindowBytes = std::max<uint64_t>(Opts.WindowBytes, 1);
+  std::vector<CSVChunk> Chunks;
+  while (Pos < End) {
+    // Split the window at line ends, so that every chunk parses on its own.
+    size_t N = 0;
+    auto WindowEnd = Pos + std::min<uint64_t>(WindowBytes, End - Pos);
+    while (Pos < WindowEnd) {
+      auto Next =
+          nextLine(Pos + std::min<uint64_t>(ChunkBytes, End - Pos) - 1, End);
+      if (N == Chunks.size())
+        Chunks.emplace_back();
+      Chunks[N].Begin = Pos;
+      Chunks[N].End = Next;
+      ++N;
+      Pos = Next;
+    }
+    CSVWindow W = {Map, Arity, Chunks.data()};
+    kale_pfor(mapLines, reinterpret_cast<const double *>(&W), 0, N, 1, 0);
+    for (size_t I = 0; I < N; ++I) {
+      auto &C = Chunks[I];
+      if (C.Error)
+        return createStringError(
+            inconvertibleErrorCode(), "%s:%llu: expected %u numbers",
+            Input.str().c_str(),
+            (unsigned long long)std::count(Start, C.Error, '\n') + 1, Arity);
+      Out.os().write(reinterpret_cast<const char *>(C.Results.data()),
+                     C.Results.size() * sizeof(double));
+      Stats.Rows += C.Results.size();
+    }
+  }
+  Out.os().close();
+  if (Out.os().has_error())
+    return createFileError(Output, Out.os().error());
+  Out.keep();
+  Stats.BytesOut = Stats.Rows * sizeof(double);
+  return Stats;
+}
@@ -0,0 +1,126 @@
+#include "swap.h"
+#include "jit.h"
+#include "map.h"
+
+#include <chrono>
+#include <iostream>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+Error SwapManager::addDefinition(std::shared_ptr<FuncAST> ast) {
+  // Callers, and the host's Fn handles, were compiled against the published
+  // prototype and would call the new version through the same stub.
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto I = Definitions.find(ast->proto.name.str());
+    if (I != Definitions.end() && I->second.Proto &&
+        !I->second.Proto->hasSameSignature(ast->proto))
+      return createStringError(inconvertibleErrorCode(),
+                               "'%s' cannot be redefined with other types",
+                               ast->proto.name.str().str().c_str());
+  }
+  // Memoized defs that call the previous version cached its results; swap
+  // them for versions with new tables.
+  auto Dependents = takeMemoDependents(ast->proto.name);
+  if (auto Err = addVersion(std::move(ast)))
+    return Err;
+  for (auto Dependent : Dependents)
+    if (auto DependentAST = getDefinition(Dependent))
+      if (auto Err = addVersion(std::move(DependentAST)))
+        return Err;
+  return Error::success();
+}
+
+Error SwapManager::addVersion(std::shared_ptr<FuncAST> ast) {
+  auto Start = std::chrono::steady_clock::now();
+  auto Key = ast->proto.name.str();
+  uint64_t Version;
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Version = ++Definitions[Key].Started;
+  }
+  auto Name = (Key + "$v" + Twine(Version)).str();
+  EnsureModule();
+  ast->codegen()->setName(Name);
+  if (Engine.Verbose >= Verbosity::IR) {
+    TheModule->print(llvm::errs(), nullptr);
+    std::cerr << std::endl;
+  }
+  auto Code = Engine.JIT->getMainJITDylib().createResourceTracker();
+  if (auto Err = Engine.JIT->addModule(TakeModule(), Code))
+    return Err;
+  auto Sym = [&] {
+    TimeTraceScope Trace("Materialize", Name);
+    return Engine.JIT->lookup(Name);
+  }();
+  if (!Sym)
+    return joinErrors(Sym.takeError(), Code->remove());
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto &Def = Definitions[Key];
+    // A later version may have been published by another thread already.
+    if (Version > Def.Version) {
+      if (auto Err = Engine.JIT->setStub(Key, Sym->getAddress()))
+        return joinErrors(std::move(Err), Code->remove());
+      Def.Version = Version;
+      Def.Proto = ast->proto;
+      std::swap(Def.Code, Code);
+    }
+    if (Code)
+      Retired.push_back({Epoch++, std::move(Code)});
+    if (Version > 1) {
+      std::chrono::duration<double> Time =
+          std::chrono::steady_clock::now() - Start;
+      ++Redefinitions;
+      RedefineSeconds += Time.count();
+      MaxRedefineSeconds = std::max(MaxRedefineSeconds, Time.count());
+    }
+  }
+  return collect();
+}
+
+uint64_t SwapManager::enter() {
+  std::lock_guard<std::mutex> Guard(Lock);
+  ++Running[Epoch];
+  return Epoch;
+}
+
+Error SwapManager::leave(uint64_t Started) {
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto I = Running.find(Started);
+    if (!--I->second)
+      Running.erase(I);
+  }
+  return collect();
+}
+
+Error SwapManager::collect() {
+  std::vector<ResourceTrackerSP> Free;
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    // Evaluations that started after a retirement only reach the new code.
+    uint64_t Oldest = Running.empty() ? UINT64_MAX : Running.begin()->first;
+    size_t N = 0;
+    while (N < Retired.size() && Retired[N].first < Oldest)
+      Free.push_back(std::move(Retired[N++].second));
+    Retired.erase(Retired.begin(), Retired.begin() + N);
+    Freed += N;
+  }
+  Error Err = Error::success();
+  for (auto &Code : Free)
+    Err = joinErrors(std::move(Err), Code->remove());
+  return Err;
+}
+
+void SwapManager::printStats(raw_ostream &OS) {
+  std::lock_guard<std::mutex> Guard(Lock);
+  OS << "Swap: " << Redefinitions << " redefinitions";
+  if (Redefinitions)
+    OS << format(", %.3f ms mean, %.3f ms max",
+                 RedefineSeconds / Redefinitions * 1e3,
+                 MaxRedefineSeconds * 1e3);
+  OS << "; " << Freed << " versions freed, " << Retired.size()
+     << " waiting for evaluations to return\n";
+}
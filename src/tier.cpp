@@ -0,0 +1,177 @@
+#include "tier.h"
+#include "jit.h"
+#include "llvm.h"
+#include "map.h"
+
+#include <iostream>
+
+using namespace llvm;
+using namespace llvm::orc;
+
+// Counts calls at the entry of F, and calls kale_tier_up(Tier, Name, Version)
+// from the Threshold-th one. The manager is passed along because the call can
+// come from any thread, including ones that never set TheEngine.
+static void addCallCounter(Function *F, TierManager *Tier, StringRef Name,
+                           uint64_t Version, uint64_t Threshold) {
+  auto &Ctx = F->getContext();
+  auto M = F->getParent();
+  auto Int64Ty = Type::getInt64Ty(Ctx);
+  auto Counter = new GlobalVariable(*M, Int64Ty, false,
+                                    GlobalValue::InternalLinkage,
+                                    ConstantInt::get(Int64Ty, 0),
+                                    F->getName() + ".calls");
+  auto PtrTy = PointerType::getUnqual(Ctx);
+  auto TierUp = M->getOrInsertFunction("kale_tier_up", Type::getVoidTy(Ctx),
+                                       PtrTy, PtrTy, Int64Ty);
+  auto Body = &F->getEntryBlock();
+  auto Count = BasicBlock::Create(Ctx, "count", F, Body);
+  auto Promote = BasicBlock::Create(Ctx, "promote", F, Body);
+  IRBuilder<> B(Count);
+  auto Calls = B.CreateAtomicRMW(AtomicRMWInst::Add, Counter, B.getInt64(1),
+                                 MaybeAlign(8), AtomicOrdering::Monotonic);
+  B.CreateCondBr(B.CreateICmpEQ(Calls, B.getInt64(Threshold - 1)), Promote,
+                 Body);
+  B.SetInsertPoint(Promote);
+  auto TierPtr = ConstantExpr::getIntToPtr(
+      B.getInt64(reinterpret_cast<uintptr_t>(Tier)), PtrTy);
+  B.CreateCall(TierUp, {TierPtr, B.CreateGlobalStringPtr(Name),
+                        B.getInt64(Version)});
+  B.CreateBr(Body);
+}
+
+Error TierManager::addDefinition(std::shared_ptr<FuncAST> ast) {
+  // Callers, and the host's Fn handles, were compiled against the current
+  // prototype and would call either tier of the new one through its stub.
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto I = Definitions.find(ast->proto.name.str());
+    if (I != Definitions.end() &&
+        !I->second.ast->proto.hasSameSignature(ast->proto))
+      return createStringError(inconvertibleErrorCode(),
+                               "'%s' cannot be redefined with other types",
+                               ast->proto.name.str().str().c_str());
+  }
+  // Memoized defs that call the previous definition cached its results;
+  // start them over from baselines with new tables.
+  auto Dependents = takeMemoDependents(ast->proto.name);
+  if (auto Err = addBaseline(std::move(ast)))
+    return Err;
+  for (auto Dependent : Dependents) {
+    std::shared_ptr<FuncAST> DependentAST;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      DependentAST = Definitions.lookup(Dependent.str()).ast;
+    }
+    if (DependentAST)
+      if (auto Err = addBaseline(std::move(DependentAST)))
+        return Err;
+  }
+  return Error::success();
+}
+
+Error TierManager::addBaseline(std::shared_ptr<FuncAST> ast) {
+  uint64_t Version;
+  StringSet<> Stale;
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto &Def = Definitions[ast->proto.name.str()];
+    Def.ast = ast;
+    Version = ++Def.version;
+    if (auto I = Importers.find(ast->proto.name.str()); I != Importers.end()) {
+      Stale = std::move(I->second);
+      Importers.erase(I);
+    }
+  }
+  auto Name = (ast->proto.name.str() + "$t0." + Twine(Version)).str();
+  EnsureModule();
+  auto F = ast->codegen(/*Optimize=*/false);
+  F->setName(Name);
+  addCallCounter(F, this, ast->proto.name.str(), Version, Threshold);
+  if (Engine.Verbose >= Verbosity::IR) {
+    TheModule->print(llvm::errs(), nullptr);
+    std::cerr << std::endl;
+  }
+  if (auto Err = Engine.JIT->addBaselineModule(TakeModule()))
+    return Err;
+  TimeTraceScope Trace("Materialize", Name);
+  auto Sym = Engine.JIT->lookup(Name);
+  if (!Sym)
+    return Sym.takeError();
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (Definitions[ast->proto.name.str()].version == Version)
+      if (auto Err =
+              Engine.JIT->setStub(ast->proto.name.str(), Sym->getAddress()))
+        return Err;
+  }
+  // Optimized callers inlined the previous body; start them over from a
+  // baseline that calls the new one.
+  for (auto &Caller : Stale) {
+    std::shared_ptr<FuncAST> CallerAST;
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      CallerAST = Definitions[Caller.getKey()].ast;
+    }
+    if (auto Err = addBaseline(std::move(CallerAST)))
+      return Err;
+  }
+  return Error::success();
+}
+
+void TierManager::promote(StringRef Name, uint64_t Version) {
+  std::shared_ptr<FuncAST> ast;
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto I = Definitions.find(Name);
+    if (I == Definitions.end() || I->second.version != Version)
+      return;
+    ast = I->second.ast;
+  }
+  Pool.async([this, ast, Version] {
+    // The worker has its own thread-local context, module and managers.
+    EngineScope Scope(Engine);
+    InitializeModuleAndManagers();
+    auto Name = (ast->proto.name.str() + "$t1." + Twine(Version)).str();
+    ast->codegen(/*Optimize=*/false)->setName(Name);
+    auto Imported = importCallees();
+    // Use -O3 whatever -O level was selected.
+    {
+      TimeTraceScope Trace("Optimize", Name);
+      OptimizeModule(*TheModule, OptimizationLevel::O3);
+    }
+    auto Sym = [&]() -> Expected<ExecutorSymbolDef> {
+      if (auto Err = Engine.JIT->addModule(TakeModule()))
+        return std::move(Err);
+      TimeTraceScope Trace("Materialize", Name);
+      return Engine.JIT->lookup(Name);
+    }();
+    std::lock_guard<std::mutex> Guard(Lock);
+    if (!Sym) {
+      Errors = joinErrors(std::move(Errors), Sym.takeError());
+      return;
+    }
+    // Skip the swap if the function was redefined in the meantime.
+    if (Definitions[ast->proto.name.str()].version != Version)
+      return;
+    // Skip it too if a callee it inlined was, as the baseline calls the new
+    // one. Otherwise a later redefinition of the callee recompiles it.
+    for (auto &Callee : Imported)
+      if (Definitions[Callee->proto.name.str()].ast != Callee)
+        return;
+    for (auto &Callee : Imported)
+      Importers[Callee->proto.name.str()].insert(ast->proto.name.str());
+    if (auto Err =
+            Engine.JIT->setStub(ast->proto.name.str(), Sym->getAddress()))
+      Errors = joinErrors(std::move(Errors), std::move(Err));
+  });
+}
+
+Error TierManager::takeErrors() {
+  std::lock_guard<std::mutex> Guard(Lock);
+  return std::move(Errors);
+}
+
+extern "C" void kale_tier_up(TierManager *Tier, const char *Name,
+                             uint64_t Version) {
+  Tier->promote(Name, Version);
+}